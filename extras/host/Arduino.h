@@ -0,0 +1,52 @@
+/*
+ * Minimal Arduino core for building i2cfs on a Linux host.
+ *
+ * Only what the library uses is provided. Time is not real time: millis(),
+ * micros() and delay() run on the modeled clock of the EEPROM simulator
+ * (see eeprom_sim.h), so the cost of a filesystem operation can be measured
+ * exactly as the bus would see it.
+ */
+
+#ifndef I2CFS_HOST_ARDUINO_H
+#define I2CFS_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+#define PROGMEM
+#define PSTR(s)            (s)
+#define printf_P           printf
+#define snprintf_P         snprintf
+#define memcpy_P           memcpy
+#define pgm_read_byte(p)   (*(const uint8_t*)(p))
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+
+#ifndef max
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+
+#define LOW    0
+#define HIGH   1
+#define INPUT  0
+#define OUTPUT 1
+
+unsigned long millis();
+unsigned long micros();
+void          delay(unsigned long ms);
+void          delayMicroseconds(unsigned int us);
+
+// Chip select lines of the simulated SPI parts, see eeprom_sim.h
+
+void          pinMode(uint8_t pin, uint8_t mode);
+void          digitalWrite(uint8_t pin, uint8_t value);
+
+#endif
@@ -0,0 +1,20 @@
+#include "SPI.h"
+#include "eeprom_sim.h"
+
+SPIClass SPI;
+
+// ---------------------------------------------------------------------------------------------
+
+void SPIClass::begin() {
+}
+
+void SPIClass::beginTransaction(const SPISettings& settings) {
+	sim_set_bus_clock(settings.clock);
+}
+
+void SPIClass::endTransaction() {
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+	return sim_spi_transfer(data);
+}
@@ -0,0 +1,41 @@
+/*
+ * Host replacement for the Arduino SPI library.
+ *
+ * Bytes go to the simulated part whose chip select pin is LOW (see
+ * digitalWrite() and eeprom_sim.h), at the clock of the transaction.
+ */
+
+#ifndef I2CFS_HOST_SPI_H
+#define I2CFS_HOST_SPI_H
+
+#include "Arduino.h"
+
+#define MSBFIRST  1
+#define SPI_MODE0 0
+
+class SPISettings {
+
+  public:
+
+  uint32_t clock;
+
+  SPISettings(uint32_t clock = 4000000, uint8_t bit_order = MSBFIRST, uint8_t data_mode = SPI_MODE0)
+    : clock(clock) {}
+
+};
+
+class SPIClass {
+
+  public:
+
+  void    begin();
+  void    beginTransaction(const SPISettings& settings);
+  void    endTransaction();
+
+  uint8_t transfer(uint8_t data);
+
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,118 @@
+#include "Wire.h"
+#include "eeprom_sim.h"
+
+TwoWire Wire;
+
+// Bit times of a transaction: START, 9 clocks per byte (8 data + ACK), STOP
+
+static uint32_t transaction_bits(uint16_t bytes) {
+	return 1 + 9 * (uint32_t) bytes + 1;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+TwoWire::TwoWire() : tx_address(0), tx_length(0), transmitting(false), rx_index(0), rx_length(0) {
+}
+
+void TwoWire::begin() {
+}
+
+void TwoWire::setClock(uint32_t hz) {
+	sim_set_bus_clock(hz);
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+	tx_address   = address;
+	tx_length    = 0;
+	transmitting = true;
+}
+
+void TwoWire::beginTransmission(int address) {
+	beginTransmission((uint8_t) address);
+}
+
+size_t TwoWire::write(uint8_t data) {
+
+	if(!transmitting || tx_length >= BUFFER_LENGTH) return 0;
+	tx_buffer[tx_length++] = data;
+	return 1;
+}
+
+size_t TwoWire::write(const uint8_t* data, size_t quantity) {
+
+	size_t written = 0;
+	while(quantity-- && write(*data++)) written++;
+	return written;
+}
+
+uint8_t TwoWire::endTransmission(uint8_t sendStop) {
+
+	SimStats&  stats = sim_stats();
+	EepromSim* chip  = sim_find(tx_address);
+
+	transmitting = false;
+	stats.transactions++;
+
+	if(!chip || chip->busy()) {
+
+		// Control byte not acknowledged, the master gives up and sends STOP
+
+		stats.nacks++;
+		stats.bytes++;
+		sim_charge_bus(transaction_bits(1));
+		return 2;
+	}
+
+	stats.bytes += 1 + tx_length;
+	sim_charge_bus(transaction_bits(1 + tx_length));
+
+	chip->write_transaction(tx_address, tx_buffer, tx_length);
+	tx_length = 0;
+
+	return 0;
+}
+
+uint8_t TwoWire::requestFrom(int address, int quantity, int sendStop) {
+
+	SimStats&  stats = sim_stats();
+	EepromSim* chip  = sim_find((uint8_t) address);
+
+	rx_index  = 0;
+	rx_length = 0;
+
+	if(quantity > BUFFER_LENGTH) quantity = BUFFER_LENGTH;
+	if(quantity <= 0) return 0;
+
+	stats.transactions++;
+
+	if(!chip || chip->busy()) {
+		stats.nacks++;
+		stats.bytes++;
+		sim_charge_bus(transaction_bits(1));
+		return 0;
+	}
+
+	stats.bytes += 1 + quantity;
+	sim_charge_bus(transaction_bits(1 + quantity));
+
+	chip->read_transaction(rx_buffer, (uint8_t) quantity);
+	rx_length = (uint8_t) quantity;
+
+	return rx_length;
+}
+
+int TwoWire::available() {
+	return rx_length - rx_index;
+}
+
+int TwoWire::read() {
+
+	if(rx_index >= rx_length) return -1;
+	return rx_buffer[rx_index++];
+}
+
+int TwoWire::peek() {
+
+	if(rx_index >= rx_length) return -1;
+	return rx_buffer[rx_index];
+}
@@ -0,0 +1,55 @@
+/*
+ * Host replacement for the Arduino Wire library.
+ *
+ * Transactions are not sent anywhere: they are handed to the EEPROM
+ * simulator, which decodes them the way a 24LCxx would and charges the
+ * modeled bus time. Return codes and buffer limits follow the AVR TwoWire
+ * implementation, so code that works here behaves the same on the board.
+ */
+
+#ifndef I2CFS_HOST_WIRE_H
+#define I2CFS_HOST_WIRE_H
+
+#include "Arduino.h"
+
+#ifndef BUFFER_LENGTH
+#define BUFFER_LENGTH 32
+#endif
+
+class TwoWire {
+
+  uint8_t  tx_address;
+  uint8_t  tx_buffer[BUFFER_LENGTH];
+  uint8_t  tx_length;
+  bool     transmitting;
+
+  uint8_t  rx_buffer[BUFFER_LENGTH];
+  uint8_t  rx_index;
+  uint8_t  rx_length;
+
+  public:
+
+  TwoWire();
+
+  void    begin();
+  void    setClock(uint32_t hz);
+
+  void    beginTransmission(uint8_t address);
+  void    beginTransmission(int address);
+  uint8_t endTransmission(uint8_t sendStop = true);
+
+  size_t  write(uint8_t data);
+  size_t  write(const uint8_t* data, size_t quantity);
+  size_t  write(int data) { return write((uint8_t) data); }
+
+  uint8_t requestFrom(int address, int quantity, int sendStop = true);
+
+  int     available();
+  int     read();
+  int     peek();
+
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,398 @@
+#include "eeprom_sim.h"
+#include "Arduino.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static EepromSim* chips[SIM_MAX_CHIPS];
+static uint32_t   bus_hz = 100000;
+static uint64_t   clock_ns;
+static SimStats   stats;
+static EepromSim* spi_selected;
+
+// 25xx / FM25 commands
+
+#define SPI_WREN  0x06
+#define SPI_RDSR  0x05
+#define SPI_READ  0x03
+#define SPI_WRITE 0x02
+
+// ---------------------------------------------------------------------------------------------
+
+EepromSim::EepromSim(uint8_t i2c_addr, uint32_t size, uint16_t page_size, uint32_t write_cycle_us)
+	: i2c_addr(i2c_addr), size(size), page_size(page_size), write_cycle_us(write_cycle_us),
+	  addr_bytes(2), select_bits(0), mem(0), pointer(0), busy_until_ns(0), mapped(0), from_file(false),
+	  spi_count(0), spi_opcode(0), spi_address(0), write_enabled(false), spi_wrote(false)
+{
+}
+
+EepromSim::EepromSim(uint8_t i2c_addr, const DEVICE_PROFILE& profile, uint32_t write_cycle_us)
+	: i2c_addr(i2c_addr), size(profile.size), page_size(profile.page_size),
+	  write_cycle_us(write_cycle_us ? write_cycle_us : profile.write_cycle_ms * 1000UL),
+	  addr_bytes(2), select_bits(profile.select_bits), mem(0), pointer(0), busy_until_ns(0), mapped(0), from_file(false),
+	  spi_count(0), spi_opcode(0), spi_address(0), write_enabled(false), spi_wrote(false)
+{
+}
+
+EepromSim::~EepromSim() {
+	detach();
+}
+
+bool EepromSim::attach(const char* image_path) {
+
+	detach();
+
+	if(!image_path) {
+		void* area = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(area == MAP_FAILED) return false;
+		mem    = (uint8_t*) area;
+		mapped = size;
+		memset(mem, 0xFF, size);
+		return true;
+	}
+
+	int fd = open(image_path, O_RDWR | O_CREAT, 0644);
+	if(fd < 0) {
+		perror(image_path);
+		return false;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	off_t old_size = st.st_size;
+
+	if(old_size < (off_t) size && ftruncate(fd, size) != 0) {
+		perror(image_path);
+		::close(fd);
+		return false;
+	}
+
+	void* area = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if(area == MAP_FAILED) {
+		perror(image_path);
+		return false;
+	}
+
+	mem       = (uint8_t*) area;
+	mapped    = size;
+	from_file = true;
+
+	if(old_size < (off_t) size) memset(mem + old_size, 0xFF, size - old_size);
+
+	return true;
+}
+
+void EepromSim::detach() {
+
+	if(!mem) return;
+	if(from_file) msync(mem, mapped, MS_SYNC);
+	munmap(mem, mapped);
+	mem       = 0;
+	mapped    = 0;
+	from_file = false;
+}
+
+bool EepromSim::busy() const {
+	return clock_ns < busy_until_ns;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+bool EepromSim::write_transaction(uint8_t control, const uint8_t* buffer, uint8_t length) {
+
+	// Control byte only: an ACK poll, nothing changes
+
+	if(length < addr_bytes) return true;
+
+	uint32_t address = 0;
+	for(uint8_t i = 0; i < addr_bytes; i++) address = (address << 8) | *buffer++;
+	length -= addr_bytes;
+
+	// Block select bits of the control byte are the address bits above
+
+	if(select_bits) {
+		uint8_t shift = 0;
+		while(!(select_bits & (1 << shift))) shift++;
+		address |= (uint32_t)((control & select_bits) >> shift) << (addr_bytes * 8);
+	}
+
+	pointer = address & (size - 1);
+	stats.address_phases++;
+
+	if(!length) return true;   // Dummy write, sets the address counter only
+
+	// Page write: the low bits roll over inside the page, as on the chip
+
+	uint32_t page_base = pointer & ~(uint32_t)(page_size - 1);
+	uint32_t offset    = pointer - page_base;
+
+	while(length--) {
+		mem[page_base + offset] = *buffer++;
+		offset = (offset + 1) & (page_size - 1);
+		stats.bytes_written++;
+	}
+
+	pointer       = page_base + offset;
+	busy_until_ns = clock_ns + (uint64_t) write_cycle_us * 1000;
+	stats.write_cycles++;
+
+	return true;
+}
+
+bool EepromSim::read_transaction(uint8_t* buffer, uint8_t length) {
+
+	// The counter rolls over at the end of the array, or of the 64 KB
+	// bank on parts with block select bits
+
+	uint32_t bank = select_bits ? 0xFFFF : size - 1;
+
+	while(length--) {
+		*buffer++ = mem[pointer];
+		pointer   = (pointer & ~bank) | ((pointer + 1) & bank);
+		stats.bytes_read++;
+	}
+
+	return true;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+void EepromSim::spi_select(bool selected) {
+
+	if(selected) {
+		spi_count = 0;
+		spi_wrote = false;
+		stats.transactions++;
+		sim_charge_bus(1);
+		return;
+	}
+
+	// Raising chip select after WRITE data starts the write cycle and
+	// clears the write enable latch
+
+	if(spi_wrote) {
+		busy_until_ns = clock_ns + (uint64_t) write_cycle_us * 1000;
+		write_enabled = false;
+		stats.write_cycles++;
+	}
+}
+
+uint8_t EepromSim::spi_transfer(uint8_t data) {
+
+	uint32_t index     = spi_count++;
+	uint8_t  spi_bytes = size > 0x10000 ? 3 : 2;
+
+	if(!index) {
+		spi_opcode  = data;
+		spi_address = 0;
+		if(busy() && data != SPI_RDSR) spi_opcode = 0;   // Ignored during the write cycle
+		if(spi_opcode == SPI_WREN) write_enabled = true;
+		return 0xFF;
+	}
+
+	switch(spi_opcode) {
+
+		case SPI_RDSR:
+			if(busy()) stats.nacks++;
+			return (busy() ? 0x01 : 0) | (write_enabled ? 0x02 : 0);
+
+		case SPI_READ:
+		case SPI_WRITE:
+			if(index <= spi_bytes) {
+				spi_address = (spi_address << 8) | data;
+				if(index == spi_bytes) {
+					pointer = spi_address & (size - 1);
+					stats.address_phases++;
+				}
+				return 0xFF;
+			}
+
+			if(spi_opcode == SPI_READ) {
+				uint8_t value = mem[pointer];
+				pointer = (pointer + 1) & (size - 1);
+				stats.bytes_read++;
+				return value;
+			}
+
+			// Page write: the low bits roll over inside the page
+
+			if(write_enabled) {
+				uint32_t page_base = pointer & ~(uint32_t)(page_size - 1);
+				mem[pointer] = data;
+				pointer      = page_base | ((pointer + 1) & (page_size - 1));
+				spi_wrote    = true;
+				stats.bytes_written++;
+			}
+			return 0xFF;
+	}
+
+	return 0xFF;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+static const struct {
+	const char*           name;
+	const DEVICE_PROFILE* profile;
+} profiles[] = {
+	{ "24LC64",     &DEVICE_24LC64      },
+	{ "24LC128",    &DEVICE_24LC128     },
+	{ "24LC256",    &DEVICE_24LC256     },
+	{ "24LC512",    &DEVICE_24LC512     },
+	{ "24LC1025",   &DEVICE_24LC1025    },
+	{ "24CM02",     &DEVICE_24CM02      },
+	{ "AT24C32",    &DEVICE_AT24C32     },
+	{ "AT24C64",    &DEVICE_AT24C64     },
+	{ "AT24C128",   &DEVICE_AT24C128    },
+	{ "AT24C256",   &DEVICE_AT24C256    },
+	{ "AT24C512",   &DEVICE_AT24C512    },
+	{ "AT24CM01",   &DEVICE_AT24CM01    },
+	{ "AT24CM02",   &DEVICE_AT24CM02    },
+	{ "FM24CL64",   &DEVICE_FM24CL64    },
+	{ "MB85RC256V", &DEVICE_MB85RC256V  },
+	{ "25LC256",    &DEVICE_25LC256     },
+	{ "25LC1024",   &DEVICE_25LC1024    },
+	{ "FM25V02",    &DEVICE_FM25V02     },
+	{ "MB85RS256",  &DEVICE_MB85RS256   },
+	{ "FM25V10",    &DEVICE_FM25V10     },
+};
+
+const DEVICE_PROFILE* sim_profile(const char* name) {
+
+	for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+		if(strcasecmp(name, profiles[i].name) == 0) return profiles[i].profile;
+	}
+	return 0;
+}
+
+void sim_list_profiles() {
+
+	for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+		fprintf(stderr, "  %-10s %4lu KB, %3u byte page, %2u ms\n", profiles[i].name,
+		        (unsigned long) profiles[i].profile->size / 1024,
+		        profiles[i].profile->page_size, profiles[i].profile->write_cycle_ms);
+	}
+}
+
+// ---------------------------------------------------------------------------------------------
+
+void sim_attach(EepromSim* chip) {
+
+	for(uint8_t i = 0; i < SIM_MAX_CHIPS; i++) {
+		if(!chips[i]) {
+			chips[i] = chip;
+			return;
+		}
+	}
+}
+
+void sim_detach(EepromSim* chip) {
+
+	for(uint8_t i = 0; i < SIM_MAX_CHIPS; i++) {
+		if(chips[i] == chip) chips[i] = 0;
+	}
+}
+
+EepromSim* sim_find(uint8_t i2c_addr) {
+
+	for(uint8_t i = 0; i < SIM_MAX_CHIPS; i++) {
+		if(chips[i] && chips[i]->i2c_addr == (i2c_addr & ~chips[i]->select_bits)) return chips[i];
+	}
+	return 0;
+}
+
+void sim_set_bus_clock(uint32_t hz) {
+	bus_hz = hz;
+}
+
+uint32_t sim_bus_clock() {
+	return bus_hz;
+}
+
+uint8_t sim_spi_transfer(uint8_t data) {
+
+	stats.bytes++;
+	sim_charge_bus(8);
+
+	if(!spi_selected) return 0xFF;
+	return spi_selected->spi_transfer(data);
+}
+
+uint64_t sim_now_ns() {
+	return clock_ns;
+}
+
+void sim_advance_ns(uint64_t ns) {
+	clock_ns += ns;
+}
+
+void sim_charge_bus(uint32_t bits) {
+
+	uint64_t ns = (uint64_t) bits * 1000000000ULL / bus_hz;
+	clock_ns     += ns;
+	stats.bus_ns += ns;
+}
+
+SimStats& sim_stats() {
+	return stats;
+}
+
+void sim_reset_stats() {
+	memset(&stats, 0, sizeof(stats));
+}
+
+void sim_print_stats(const SimStats& s) {
+
+	printf("transactions:   %lu (%lu address phases, %lu nacks)\n",
+	       (unsigned long) s.transactions, (unsigned long) s.address_phases, (unsigned long) s.nacks);
+	printf("bus bytes:      %lu (%lu read, %lu written)\n",
+	       (unsigned long) s.bytes, (unsigned long) s.bytes_read, (unsigned long) s.bytes_written);
+	printf("write cycles:   %lu\n", (unsigned long) s.write_cycles);
+	printf("bus time:       %.3f ms\n", s.bus_ns / 1e6);
+	printf("waited:         %.3f ms\n", s.wait_ns / 1e6);
+}
+
+// ---------------------------------------------------------------------------------------------
+// Arduino time functions run on the modeled clock
+
+unsigned long millis() {
+	return (unsigned long)(clock_ns / 1000000);
+}
+
+unsigned long micros() {
+	return (unsigned long)(clock_ns / 1000);
+}
+
+void delay(unsigned long ms) {
+	clock_ns      += (uint64_t) ms * 1000000;
+	stats.wait_ns += (uint64_t) ms * 1000000;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+
+	// Chip select of an SPI part, active LOW
+
+	EepromSim* chip = sim_find(pin);
+	if(!chip) return;
+
+	if(value == LOW && spi_selected != chip) {
+		spi_selected = chip;
+		chip->spi_select(true);
+	} else if(value == HIGH && spi_selected == chip) {
+		spi_selected = 0;
+		chip->spi_select(false);
+	}
+}
+
+void delayMicroseconds(unsigned int us) {
+	clock_ns      += (uint64_t) us * 1000;
+	stats.wait_ns += (uint64_t) us * 1000;
+}
@@ -0,0 +1,145 @@
+/*
+ * Simulated I2C EEPROM with a device timing model.
+ *
+ * A chip is backed by an image file mapped in memory (or by anonymous memory
+ * when no file is given) and answers on the host Wire bus. The model keeps
+ * what costs time on a real 24LCxx:
+ *
+ *  - every START, control byte, address byte and data byte is charged at
+ *    the bus clock (9 bit times per byte, plus START/STOP),
+ *  - the internal address counter auto-increments and rolls over at the
+ *    end of the array, so current address reads work as on the chip,
+ *  - page writes wrap inside the physical page, exactly like the device,
+ *    so a write that crosses a page boundary corrupts data here too,
+ *  - a STOP after data bytes starts the internal write cycle; until it is
+ *    over the chip does not acknowledge its address,
+ *  - parts over 64 KB answer on every device address their block select
+ *    bits give, take A16 and up from the control byte of a write and roll
+ *    the counter over inside each 64 KB bank.
+ *
+ * The same chip can sit on the host SPI bus instead, as a 25LCxx EEPROM or
+ * an FM25 FRAM (write cycle 0). Its i2c_addr is then the pin of its chip
+ * select: driving it LOW starts a command (WREN, RDSR, READ, WRITE with a
+ * 16-bit address, 24-bit over 64 KB), HIGH ends it and starts the write
+ * cycle of a WRITE. While the cycle runs only RDSR is answered.
+ *
+ * All time is modeled: the clock only moves when the bus is used or when
+ * the sketch calls delay().
+ */
+
+#ifndef I2CFS_EEPROM_SIM_H
+#define I2CFS_EEPROM_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "i2cfs_devices.h"
+
+#define SIM_MAX_CHIPS 8
+
+struct SimStats {
+
+  uint32_t transactions;              // START conditions put on the bus
+  uint32_t address_phases;            // Transactions that (re)loaded the memory address
+  uint32_t nacks;                     // Transactions refused by a busy or absent chip
+  uint32_t bytes;                     // Bytes clocked on the bus, control and address included
+  uint32_t bytes_read;                // Data bytes read from the array
+  uint32_t bytes_written;             // Data bytes written to the array
+  uint32_t write_cycles;              // Internal write cycles started
+  uint64_t bus_ns;                    // Time the bus was driven
+  uint64_t wait_ns;                   // Time spent in delay()
+
+};
+
+class EepromSim {
+
+  public:
+
+  uint8_t   i2c_addr;
+  uint32_t  size;                     // Size of array in bytes
+  uint16_t  page_size;                // Physical page size in bytes
+  uint32_t  write_cycle_us;           // Duration of the internal write cycle
+  uint8_t   addr_bytes;               // Memory address bytes sent after the control byte
+  uint8_t   select_bits;              // Device address bits taking A16 and up
+
+  uint8_t*  mem;
+  uint32_t  pointer;                  // Internal address counter
+  uint64_t  busy_until_ns;            // End of the running write cycle
+
+  EepromSim(uint8_t  i2c_addr,
+            uint32_t size,
+            uint16_t page_size,
+            uint32_t write_cycle_us);
+
+  /**
+   * Chip with the geometry of a device profile
+   *
+   * The write cycle lasts the maximum tWC of the profile unless
+   * write_cycle_us gives the time a real part takes.
+   */
+
+  EepromSim(uint8_t  i2c_addr,
+            const DEVICE_PROFILE& profile,
+            uint32_t write_cycle_us = 0);
+  ~EepromSim();
+
+  /**
+   * Maps an image file as the content of the chip
+   *
+   * The file is created, or grown, to the size of the chip. New bytes read
+   * as 0xFF like an erased EEPROM. Without a path the content lives in
+   * anonymous memory and is lost at exit.
+   */
+
+  bool      attach(const char* image_path);
+  void      detach();
+
+  bool      busy() const;
+
+  // Bus side, used by the host Wire library
+
+  bool      write_transaction(uint8_t control, const uint8_t* buffer, uint8_t length);
+  bool      read_transaction(uint8_t* buffer, uint8_t length);
+
+  // SPI side, used by the host SPI library
+
+  void      spi_select(bool selected);
+  uint8_t   spi_transfer(uint8_t data);
+
+  private:
+
+  size_t    mapped;
+  bool      from_file;
+
+  uint32_t  spi_count;                // Bytes of the command so far
+  uint8_t   spi_opcode;
+  uint32_t  spi_address;
+  bool      write_enabled;
+  bool      spi_wrote;
+
+};
+
+/**
+ * Device profile by part name ("24LC256", "AT24C32", ...), 0 if unknown
+ */
+
+const DEVICE_PROFILE* sim_profile(const char* name);
+void      sim_list_profiles();
+
+void      sim_attach(EepromSim* chip);
+void      sim_detach(EepromSim* chip);
+EepromSim* sim_find(uint8_t i2c_addr);
+
+void      sim_set_bus_clock(uint32_t hz);
+uint32_t  sim_bus_clock();
+
+uint8_t   sim_spi_transfer(uint8_t data);
+
+uint64_t  sim_now_ns();
+void      sim_advance_ns(uint64_t ns);
+void      sim_charge_bus(uint32_t bits);
+
+SimStats& sim_stats();
+void      sim_reset_stats();
+void      sim_print_stats(const SimStats& stats);
+
+#endif
@@ -0,0 +1,400 @@
+/*
+ * i2cfs_bench - bus cost of each filesystem operation
+ *
+ * Usage: i2cfs_bench [-d device] [-t write_cycle_us] [-c bus_hz] [-n chips]
+ *
+ * Formats a simulated volume, fills it to several levels with 1 KB files
+ * and, at each level, runs the same set of operations in a fresh directory.
+ * For every operation it prints, per call: the I2C transactions that were
+ * acknowledged, the ones refused by a busy chip (ACK polls), the bytes
+ * clocked on the bus, the write cycles started, the time spent waiting for
+ * them (delays and ACK polling) and the modeled wall time. Operations that
+ * leave changes in the block cache are measured with the flush() that
+ * writes them. Every byte read back is checked against what was written.
+ * With -n the volume is striped across that many chips at 0x50, 0x51, ...
+ * Built with DRIVER_SPI the chips are on the SPI bus, clocked at
+ * SPI_MEM_CLOCK instead of the -c clock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <Wire.h>
+#include <i2cfs.h>
+#ifdef DRIVER_SPI
+#include <spiutils.h>
+#define driver_stats spi_stats
+#else
+#include <i2cutils.h>
+#define driver_stats i2c_stats
+#endif
+#include "eeprom_sim.h"
+
+#define FILL_FILE_SIZE   1024
+#define RECORD_SIZE      16
+#define RECORDS          32
+#define READ_CHUNK       256
+#define SEEKS            16
+
+static I2CFS    fs;
+static uint8_t  pattern[8192];
+static uint8_t  buffer[8192];
+static int      errors;
+static uint16_t page_size;
+
+// ---------------------------------------------------------------------------------------------
+
+struct Probe {
+
+	SimStats stats;
+	uint64_t start_ns;
+	uint32_t poll_us;
+
+	void begin() {
+		stats    = sim_stats();
+		start_ns = sim_now_ns();
+		poll_us  = driver_stats.wait_us;
+	}
+
+	void end(const char* op, uint32_t calls) {
+
+		const SimStats& now = sim_stats();
+		double n = calls ? calls : 1;
+
+		printf("  %-24s %6lu %10.1f %8.1f %10.1f %8.2f %10.3f %10.3f\n", op,
+		       (unsigned long) calls,
+		       (now.transactions  - now.nacks - stats.transactions + stats.nacks) / n,
+		       (now.nacks         - stats.nacks)         / n,
+		       (now.bytes         - stats.bytes)         / n,
+		       (now.write_cycles  - stats.write_cycles)  / n,
+		       ((now.wait_ns      - stats.wait_ns) / 1e3 +
+		        (driver_stats.wait_us - poll_us))           / n / 1e3,
+		       (sim_now_ns()      - start_ns)            / n / 1e6);
+	}
+};
+
+static void check(bool ok, const char* what) {
+
+	if(ok) return;
+	printf("  ERROR: %s\n", what);
+	errors++;
+}
+
+static void format(uint16_t size_in_KB) {
+
+	// A free bitmap or link table too small for the geometry leaves the
+	// volume unformatted, nothing after that would terminate
+
+	FS_STATUS status = fs.format(size_in_KB);
+	if(status == FS_STATUS_OK) return;
+	fprintf(stderr, "i2cfs_bench: format of %u KB failed, status %u\n", size_in_KB, status);
+	exit(1);
+}
+
+// ---------------------------------------------------------------------------------------------
+
+static uint16_t fill(uint16_t target_blocks, uint16_t* files) {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	char        name[16];
+	uint32_t    written;
+
+	fs.create_directory("/fill");
+	fs.open_directory("/fill", dir);
+
+	while(fs.master_block.used_blocks + 1 < target_blocks) {
+
+		// The last file is cut short so the level lands on target
+
+		uint32_t room = (uint32_t)(target_blocks - fs.master_block.used_blocks - 1) * DATA_SIZE;
+		snprintf(name, sizeof(name), "fill%03u", *files);
+		if(fs.open(name, MODE_WRITE, dir, file) != FS_STATUS_OK) break;
+		FS_STATUS status = fs.write(file, pattern, min(FILL_FILE_SIZE, room), &written);
+		fs.close(file);
+		(*files)++;
+		if(status != FS_STATUS_OK) break;
+	}
+
+	return fs.master_block.used_blocks;
+}
+
+static void run_level(uint8_t percent) {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	Probe       probe;
+	uint32_t    done;
+	uint16_t    files = 0;
+
+	format((uint32_t) fs.master_block.total_blocks * BLOCK_SIZE / 1024);
+	uint16_t total = fs.master_block.total_blocks;
+	uint16_t used  = fill((uint32_t) total * percent / 100, &files);
+
+	// The log takes 4 * records * RECORD_SIZE bytes, the bulk file half of
+	// what is left, up to 4 KB. On a small part the fill leaves no room for
+	// RECORDS records: the log gets the records that fit, past the blocks
+	// of the directory and the log file, or is left out
+
+	uint16_t free_blocks = total - used;
+	uint16_t records     = RECORDS;
+	uint16_t log_blocks  = 2 + (4 * RECORDS * RECORD_SIZE + DATA_SIZE - 1) / DATA_SIZE;
+
+	if(free_blocks < log_blocks + 1) {
+		records    = free_blocks > 3 ? (uint32_t)(free_blocks - 3) * DATA_SIZE / (4 * RECORD_SIZE) : 0;
+		log_blocks = free_blocks;
+	}
+
+	uint16_t bulk_size   = free_blocks > log_blocks + 4 ? (free_blocks - log_blocks - 4) * DATA_SIZE / 2 : 0;
+	if(bulk_size > 4096) bulk_size = 4096;
+
+	printf("\nfill %u%%: %u of %u blocks used, %u files, log %u records, bulk %u bytes\n",
+	       percent, used, total, files, records, bulk_size);
+	printf("  %-24s %6s %10s %8s %10s %8s %10s %10s\n",
+	       "operation", "calls", "trans", "nacks", "bytes", "cycles", "wait ms", "wall ms");
+
+	if(files) {
+
+		// Lookups among the fill files
+
+		char name[16];
+		fs.open_directory("/fill", dir);
+		probe.begin();
+		for(uint16_t i = 0; i < files; i++) {
+			snprintf(name, sizeof(name), "fill%03u", i);
+			check(fs.open(name, MODE_READ, dir, file) == FS_STATUS_OK, "open(read) fill");
+			fs.close(file);
+		}
+		probe.end("open(read)+close", files);
+	}
+
+	probe.begin();
+	check(fs.create_directory("/bench") == FS_STATUS_OK, "create_directory");
+	fs.flush();
+	probe.end("create_directory", 1);
+
+	probe.begin();
+	check(fs.open_directory("/bench", dir) == FS_STATUS_OK, "open_directory");
+	probe.end("open_directory", 1);
+
+	if(records) {
+
+		probe.begin();
+		check(fs.open("log.txt", MODE_WRITE, dir, file) == FS_STATUS_OK, "open(write) new");
+		fs.flush();
+		probe.end("open(write) new", 1);
+		fs.close(file);
+
+		// Logging pattern: one record per open/write/close
+
+		probe.begin();
+		for(uint16_t i = 0; i < records; i++) {
+			fs.open("log.txt", MODE_APPEND, dir, file);
+			fs.write(file, pattern + i * RECORD_SIZE, RECORD_SIZE, &done);
+			fs.close(file);
+		}
+		probe.end("append 16B open+close", records);
+
+		// Same records on a handle kept open
+
+		fs.open("log.txt", MODE_APPEND, dir, file);
+		probe.begin();
+		for(uint16_t i = 0; i < records; i++) {
+			fs.write(file, pattern + (records + i) * RECORD_SIZE, RECORD_SIZE, &done);
+		}
+		probe.end("write 16B", records);
+		probe.begin();
+		fs.close(file);
+		probe.end("close", 1);
+
+		// And gathered in a write buffer the size of a chip page, at most
+		// 256 bytes on FRAM parts whose page is the whole array
+
+		static uint8_t write_buffer[256];
+
+		fs.open("log.txt", MODE_APPEND, dir, file);
+		fs.set_write_buffer(file, write_buffer, min(page_size, (uint16_t) sizeof(write_buffer)));
+		probe.begin();
+		for(uint16_t i = 0; i < records; i++) {
+			fs.write(file, pattern + (2 * records + i) * RECORD_SIZE, RECORD_SIZE, &done);
+		}
+		fs.close(file);
+		probe.end("write 16B buffered+close", records);
+
+		// Each record made durable with flush() while the sketch does 20 ms of
+		// its own work between records, calling poll(). Only the time spent
+		// inside write() and flush() is shown: with I2C_WRITE_QUEUE they return
+		// once the page writes are queued
+
+		uint64_t blocked_ns = 0;
+
+		while(fs.poll() == FS_STATUS_PENDING) delayMicroseconds(100);
+		fs.open("log.txt", MODE_APPEND, dir, file);
+		for(uint16_t i = 0; i < records; i++) {
+			uint64_t start = sim_now_ns();
+			fs.write(file, pattern + (3 * records + i) * RECORD_SIZE, RECORD_SIZE, &done);
+			fs.flush(file);
+			blocked_ns += sim_now_ns() - start;
+			for(uint8_t ms = 0; ms < 20; ms++) {
+				delay(1);
+				fs.poll();
+			}
+		}
+		fs.close(file);
+		while(fs.poll() == FS_STATUS_PENDING) delayMicroseconds(100);
+		printf("  %-24s %6u %48s %10.3f\n", "write 16B+flush, poll", records,
+		       "wall ms inside write()+flush():", blocked_ns / 1e6 / records);
+
+		fs.open("log.txt", MODE_READ, dir, file);
+		check(file.size == 4 * records * RECORD_SIZE, "log size");
+		fs.read(file, buffer, file.size, &done);
+		check(memcmp(buffer, pattern, 4 * records * RECORD_SIZE) == 0, "log content");
+		fs.close(file);
+	}
+
+	if(bulk_size) {
+
+		fs.open("bulk.bin", MODE_WRITE, dir, file);
+		probe.begin();
+		FS_STATUS status = fs.write(file, pattern, bulk_size, &done);
+		fs.close(file);
+		probe.end("write bulk+close", 1);
+		check(status == FS_STATUS_OK && done == bulk_size, "bulk write");
+
+		probe.begin();
+		fs.open("bulk.bin", MODE_APPEND, dir, file);
+		probe.end("open(append) bulk", 1);
+		fs.close(file);
+
+		fs.open("bulk.bin", MODE_READ, dir, file);
+		probe.begin();
+		uint16_t chunks = 0;
+		for(uint16_t pos = 0; pos < bulk_size; pos += READ_CHUNK, chunks++) {
+			fs.read(file, buffer + pos, min(READ_CHUNK, bulk_size - pos), &done);
+		}
+		probe.end("read 256B", chunks);
+		check(memcmp(buffer, pattern, bulk_size) == 0, "bulk content");
+
+		probe.begin();
+		for(uint16_t i = 0; i < SEEKS; i++) {
+			uint16_t pos = (uint32_t) bulk_size * (i * 7 % SEEKS) / SEEKS;
+			fs.seek(file, pos);
+			fs.read(file, buffer, 1, &done);
+			check(buffer[0] == pattern[pos], "seek content");
+		}
+		probe.end("seek+read 1B", SEEKS);
+		fs.close(file);
+
+		probe.begin();
+		check(fs.erase(dir, "bulk.bin") == FS_STATUS_OK, "erase bulk");
+		fs.flush();
+		probe.end("erase bulk", 1);
+	}
+
+	probe.begin();
+	check(fs.delete_directory(dir) == FS_STATUS_OK, "delete_directory");
+	fs.flush();
+	probe.end("delete_directory", 1);
+}
+
+// ---------------------------------------------------------------------------------------------
+
+static void usage() {
+	fprintf(stderr, "usage: i2cfs_bench [-d device] [-t write_cycle_us] [-c bus_hz] [-n chips] [-T trace_file]\n");
+	sim_list_profiles();
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+
+	const DEVICE_PROFILE* profile        = &DEVICE_24LC256;
+	uint32_t              write_cycle_us = 0;
+	uint32_t              bus_hz         = 100000;
+	uint8_t               chips          = 1;
+	const char*           trace_file     = 0;
+	int                   opt;
+
+	while((opt = getopt(argc, argv, "d:t:c:n:T:")) != -1) {
+		switch(opt) {
+			case 'd': if(!(profile = sim_profile(optarg))) usage(); break;
+			case 't': write_cycle_us = atoi(optarg); break;
+			case 'c': bus_hz         = atoi(optarg); break;
+			case 'n': chips          = atoi(optarg); break;
+			case 'T': trace_file     = optarg; break;
+			default : usage();
+		}
+	}
+
+	if(chips < 1 || chips > SIM_MAX_CHIPS) usage();
+
+	#if !I2CFS_TRACE
+	if(trace_file) {
+		fprintf(stderr, "i2cfs_bench: -T needs a build with I2CFS_TRACE set\n");
+		return 1;
+	}
+	#endif
+
+	uint16_t size_in_KB = profile->size / 1024 * chips;
+	page_size           = profile->page_size;
+
+	for(uint16_t i = 0; i < sizeof(pattern); i++) pattern[i] = (uint8_t)(i * 31 + (i >> 8));
+
+	// Same addresses as begin() gives the chips: block select bits skipped
+
+	EepromSim* chip[SIM_MAX_CHIPS];
+	uint8_t    address = 0x50;
+	for(uint8_t i = 0; i < chips; i++) {
+		if(i) address = ((address | profile->select_bits) + 1) & ~profile->select_bits;
+		if(address > 0x57) usage();
+		chip[i] = new EepromSim(address, *profile, write_cycle_us);
+		if(!chip[i]->attach(0)) return 1;
+		sim_attach(chip[i]);
+	}
+
+	Wire.begin();
+	Wire.setClock(bus_hz);
+	fs.begin(0x50, *profile, chips);
+
+	#ifdef DRIVER_SPI
+	printf("i2cfs_bench: %u KB on %u chip(s), page %u bytes, write cycle %lu us, SPI %lu Hz\n",
+	       size_in_KB, chips, chip[0]->page_size, (unsigned long) chip[0]->write_cycle_us, (unsigned long) SPI_MEM_CLOCK);
+	#else
+	printf("i2cfs_bench: %u KB on %u chip(s), page %u bytes, write cycle %lu us, bus %lu Hz, Wire buffer %u bytes\n",
+	       size_in_KB, chips, chip[0]->page_size, (unsigned long) chip[0]->write_cycle_us, (unsigned long) bus_hz, BUFFER_LENGTH);
+	#endif
+	printf("costs are per call; wall time is modeled bus time plus waits\n");
+
+	Probe probe;
+	probe.begin();
+	format(size_in_KB);
+	printf("\n  %-24s %6s %10s %8s %10s %8s %10s %10s\n",
+	       "operation", "calls", "trans", "nacks", "bytes", "cycles", "wait ms", "wall ms");
+	probe.end("format", 1);
+
+	static const uint8_t levels[] = { 0, 25, 50, 75, 90 };
+	for(uint8_t i = 0; i < sizeof(levels); i++) run_level(levels[i]);
+
+	// The ring keeps the last I2CFS_TRACE events of the run
+
+	#if I2CFS_TRACE
+	if(trace_file) {
+		FILE* out = fopen(trace_file, "wb");
+		if(!out) {
+			perror(trace_file);
+			return 1;
+		}
+		for(uint16_t i = 0; i < trace_count(); i++) fwrite(trace_get(i), sizeof(TRACE_RECORD), 1, out);
+		fclose(out);
+		printf("\n%u trace records written to %s\n", trace_count(), trace_file);
+	}
+	#endif
+
+	for(uint8_t i = 0; i < chips; i++) {
+		sim_detach(chip[i]);
+		delete chip[i];
+	}
+
+	if(errors) printf("\n%d ERRORS\n", errors);
+	return errors ? 1 : 0;
+}
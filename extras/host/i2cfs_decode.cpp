@@ -0,0 +1,123 @@
+/*
+ * i2cfs_decode - prints a binary trace dump as a timeline
+ *
+ * Usage: i2cfs_decode [-s] trace_file
+ *
+ * Reads the TRACE_RECORDs of a build with I2CFS_TRACE (see i2cfs_trace.h),
+ * dumped oldest first from the device or by i2cfs_bench -T, and prints one
+ * line per event with its time and the time since the previous one, then
+ * the count and bytes of each kind of event. -s prints the totals only.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <i2cfs_trace.h>
+
+static const char* const op_names[] = {
+	"?", "read", "write", "cached", "alloc", "release",
+	"open", "close", "seek", "sync", "format", "recover"
+};
+
+#define OPS (sizeof(op_names) / sizeof(op_names[0]))
+
+static void usage() {
+	fprintf(stderr, "usage: i2cfs_decode [-s] trace_file\n");
+	exit(1);
+}
+
+static void print_record(const TRACE_RECORD& record) {
+
+	const char* name = record.op < OPS ? op_names[record.op] : op_names[0];
+
+	switch(record.op) {
+		case TRACE_READ:
+		case TRACE_WRITE:
+		case TRACE_CACHED:
+			printf("%-8s block %5lu  +%-3u %5u bytes\n", name, (unsigned long) record.block, record.offset, record.length);
+			break;
+		case TRACE_RELEASE:
+			printf("%-8s block %5lu  %u block(s)\n", name, (unsigned long) record.block, record.length);
+			break;
+		case TRACE_OPEN:
+			printf("%-8s file  %5lu  mode %u\n", name, (unsigned long) record.block, record.offset);
+			break;
+		case TRACE_CLOSE:
+			printf("%-8s file  %5lu\n", name, (unsigned long) record.block);
+			break;
+		case TRACE_SEEK:
+			printf("%-8s block %5lu  +%u\n", name, (unsigned long) record.block, record.offset);
+			break;
+		case TRACE_SYNC:
+			printf("%-8s %u change(s)\n", name, record.length);
+			break;
+		case TRACE_FORMAT:
+			printf("%-8s %lu blocks\n", name, (unsigned long) record.block);
+			break;
+		case TRACE_RECOVER:
+			printf("%-8s %lu blocks, %u used\n", name, (unsigned long) record.block, record.length);
+			break;
+		default:
+			printf("%-8s block %5lu\n", name, (unsigned long) record.block);
+	}
+}
+
+int main(int argc, char** argv) {
+
+	bool totals_only = false;
+	int  opt;
+
+	while((opt = getopt(argc, argv, "s")) != -1) {
+		switch(opt) {
+			case 's': totals_only = true; break;
+			default : usage();
+		}
+	}
+
+	if(optind != argc - 1) usage();
+
+	FILE* in = fopen(argv[optind], "rb");
+	if(!in) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	TRACE_RECORD record;
+	uint32_t     records = 0;
+	uint32_t     first   = 0;
+	uint32_t     last    = 0;
+	uint32_t     count[OPS] = { 0 };
+	uint32_t     bytes[OPS] = { 0 };
+
+	if(!totals_only) printf("%12s %10s  event\n", "time ms", "+us");
+
+	while(fread(&record, sizeof(record), 1, in) == 1) {
+
+		// micros() wraps after 71 minutes, the differences stay right
+
+		if(!records) first = last = record.time_us;
+
+		if(!totals_only) {
+			printf("%12.3f %10lu  ", (record.time_us - first) / 1000.0, (unsigned long)(record.time_us - last));
+			print_record(record);
+		}
+
+		uint8_t op = record.op < OPS ? record.op : 0;
+		count[op]++;
+		if(op == TRACE_READ || op == TRACE_WRITE || op == TRACE_CACHED) bytes[op] += record.length;
+
+		last = record.time_us;
+		records++;
+	}
+
+	fclose(in);
+
+	printf("\n%lu records over %.3f ms\n", (unsigned long) records, (last - first) / 1000.0);
+	for(uint8_t op = 0; op < OPS; op++) {
+		if(!count[op]) continue;
+		if(bytes[op]) printf("  %-8s %8lu  %10lu bytes\n", op_names[op], (unsigned long) count[op], (unsigned long) bytes[op]);
+		else          printf("  %-8s %8lu\n", op_names[op], (unsigned long) count[op]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * i2cfs_mkfs - formats an EEPROM image on the host
+ *
+ * Usage: i2cfs_mkfs [-d device] [-t write_cycle_us] image
+ *
+ * Runs I2CFS::format against the simulated chip and prints what the format
+ * cost on the bus. The image can then be flashed into a chip with any
+ * programmer, or used by other host tools.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <Wire.h>
+#include <i2cfs.h>
+#ifdef DRIVER_SPI
+#include <spiutils.h>
+#define driver_stats spi_stats
+#else
+#include <i2cutils.h>
+#define driver_stats i2c_stats
+#endif
+#include "eeprom_sim.h"
+
+static void usage() {
+	fprintf(stderr, "usage: i2cfs_mkfs [-d device] [-t write_cycle_us] image\n");
+	sim_list_profiles();
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+
+	const DEVICE_PROFILE* profile        = &DEVICE_24LC256;
+	uint32_t              write_cycle_us = 0;
+	int                   opt;
+
+	while((opt = getopt(argc, argv, "d:t:")) != -1) {
+		switch(opt) {
+			case 'd': if(!(profile = sim_profile(optarg))) usage(); break;
+			case 't': write_cycle_us = atoi(optarg); break;
+			default : usage();
+		}
+	}
+
+	if(optind != argc - 1) usage();
+
+	uint16_t  size_in_KB = profile->size / 1024;
+	EepromSim chip(0x50, *profile, write_cycle_us);
+	if(!chip.attach(argv[optind])) return 1;
+	sim_attach(&chip);
+
+	I2CFS fs;
+
+	Wire.begin();
+	fs.begin(0x50, *profile);
+
+	sim_reset_stats();
+	FS_STATUS status = fs.format(size_in_KB);
+	if(status != FS_STATUS_OK) {
+		fprintf(stderr, "%s: format failed, status %u\n", argv[optind], status);
+		sim_detach(&chip);
+		return 1;
+	}
+
+	printf("%s: %u KB, %u blocks\n", argv[optind], size_in_KB, fs.master_block.total_blocks);
+	sim_print_stats(sim_stats());
+	printf("polled:         %.3f ms, longest write cycle %u us\n",
+	       driver_stats.wait_us / 1e3, driver_stats.max_wait_us);
+
+	sim_detach(&chip);
+	return 0;
+}
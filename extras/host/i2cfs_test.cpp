@@ -0,0 +1,931 @@
+/*
+ * i2cfs_test - checks of the library on the simulated chip
+ *
+ * Usage: i2cfs_test [-d device]
+ *
+ * Runs each check on a freshly formatted volume, a small 24LC64 (a 24LC256
+ * with blocks over 64 bytes) unless -d gives another part (the checks that
+ * fill it take longer on large ones), and prints one line per check. Sizes
+ * and contents are checked after the volume is mounted again, so what is
+ * verified is what reached the chip. Exits non-zero if any check failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <Wire.h>
+#include <i2cfs.h>
+#include "eeprom_sim.h"
+
+static I2CFS                 fs;
+static EepromSim*            chip;
+static const DEVICE_PROFILE* profile = BLOCK_SIZE > 64 ? &DEVICE_24LC256 : &DEVICE_24LC64;
+static uint8_t               pattern[8192];
+static uint8_t               buffer[8192];
+static uint8_t               write_buffer[256];
+static int                   failed;
+static bool                  passed;
+
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+static void check(bool ok, const char* what, int line) {
+
+	if(ok) return;
+	if(passed) printf("FAIL\n");
+	printf("    line %d: %s\n", line, what);
+	passed = false;
+}
+
+static void start(const char* name) {
+
+	printf("  %-36s ", name);
+	fflush(stdout);
+	passed = true;
+
+	FS_STATUS status = fs.format(profile->size / 1024);
+	if(status != FS_STATUS_OK) {
+		fprintf(stderr, "i2cfs_test: format failed, status %u\n", status);
+		exit(1);
+	}
+}
+
+static void finish() {
+
+	if(passed) printf("ok\n");
+	else       failed++;
+}
+
+static void remount() {
+
+	fs.sync();
+	fs.begin(0x50, *profile);
+}
+
+/*
+ * Mounts the chip again as after a reset: what the block cache held is lost
+ */
+
+static void power_loss() {
+
+	#if I2CFS_CACHE_BLOCKS
+	fs.cache_invalidate();
+	#endif
+	#if I2CFS_FAT_TABLE
+	fs.fat_dirty_to = 0;
+	#endif
+	fs.begin(0x50, *profile);
+}
+
+static BLOCK used_blocks() {
+	return fs.master_block.used_blocks;
+}
+
+/*
+ * Writes up to chunk bytes of the pattern, repeated, from offset at
+ */
+
+static FS_STATUS write_pattern(FILE_HANDLE& file, uint32_t at, uint32_t chunk, uint32_t* done) {
+
+	at %= sizeof(pattern);
+	return fs.write(file, pattern + at, min(chunk, (uint32_t)(sizeof(pattern) - at)), done);
+}
+
+/*
+ * Writes file name of directory dir with the first size bytes of the
+ * pattern, repeated, and closes it
+ */
+
+static FS_STATUS write_file(DIR_HANDLE& dir, const char* name, uint32_t size, I2CFS& volume = fs) {
+
+	FILE_HANDLE file;
+	FS_STATUS   status = volume.open(name, MODE_WRITE, dir, file);
+
+	for(uint32_t at = 0; at < size && status == FS_STATUS_OK; ) {
+		uint32_t done = 0;
+		status = volume.write(file, pattern + at % sizeof(pattern), min(size - at, (uint32_t)(sizeof(pattern) - at % sizeof(pattern))), &done);
+		at += done;
+	}
+
+	if(status != FS_STATUS_OK) return status;
+	return volume.close(file);
+}
+
+/*
+ * Checks that file name in directory holds the first size bytes of the
+ * pattern, repeated
+ */
+
+static void check_file(const char* name, uint32_t size, I2CFS& volume = fs, const char* directory = "/") {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+
+	CHECK(volume.open_directory(directory, dir) == FS_STATUS_OK);
+	CHECK(volume.open(name, MODE_READ, dir, file) == FS_STATUS_OK);
+	CHECK(file.size == size);
+
+	for(uint32_t at = 0; at < size && passed; at += sizeof(buffer)) {
+		uint32_t wanted = min(size - at, (uint32_t) sizeof(buffer));
+		uint32_t done   = 0;
+		memset(buffer, 0, wanted);
+		volume.read(file, buffer, wanted, &done);
+		CHECK(done == wanted);
+		CHECK(!memcmp(buffer, pattern, wanted));
+	}
+
+	volume.close(file);
+}
+
+// ---------------------------------------------------------------------------------------------
+
+/*
+ * Writes chunks until the disk is full: every byte write() reported, and
+ * only those, is in the file. Chunks that end inside a block make the
+ * failing write fill the old last block before no new one is found
+ */
+
+static void disk_full(const char* name, uint32_t chunk) {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	uint32_t    written = 0;
+	FS_STATUS   status  = FS_STATUS_OK;
+
+	start(name);
+	fs.open_directory("/", dir);
+	CHECK(fs.open("full", MODE_WRITE, dir, file) == FS_STATUS_OK);
+
+	while(status == FS_STATUS_OK) {
+		uint32_t done = 0;
+		status   = write_pattern(file, written, chunk, &done);
+		written += done;
+	}
+
+	CHECK(status == FS_STATUS_DISK_FULL);
+	CHECK(file.size == written);
+	fs.close(file);
+
+	remount();
+	check_file("full", written);
+	finish();
+}
+
+/*
+ * Appends through a write buffer until the disk is full. write() counts
+ * the bytes it buffered, those the disk did not take stay buffered: the
+ * chip holds the size of the handle less write_buffered. They reach it
+ * once a file is erased to make room, close() without room drops them
+ */
+
+static void disk_full_buffered(const char* name, uint32_t chunk, uint16_t buffer_size, bool make_room) {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	uint32_t    written = 0;
+	uint32_t    done    = 0;
+	FS_STATUS   status  = FS_STATUS_OK;
+
+	start(name);
+	fs.open_directory("/", dir);
+
+	CHECK(fs.open("spare", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	fs.write(file, pattern, 1024, &done);
+	fs.close(file);
+
+	CHECK(fs.open("full", MODE_APPEND, dir, file) == FS_STATUS_OK);
+	CHECK(fs.set_write_buffer(file, write_buffer, buffer_size) == FS_STATUS_OK);
+
+	while(status == FS_STATUS_OK) {
+		done     = 0;
+		status   = write_pattern(file, written, chunk, &done);
+		written += done;
+	}
+
+	uint32_t on_chip = written - file.write_buffered;
+
+	CHECK(status == FS_STATUS_DISK_FULL);
+	CHECK(file.size == written);
+	CHECK(file.write_buffered > 0);
+
+	// Still no room: nothing is lost, the handle does not move
+
+	CHECK(fs.seek(file, 0) == FS_STATUS_DISK_FULL);
+	CHECK(file.size == written);
+	CHECK(file.position == written);
+	CHECK(file.write_buffered == written - on_chip);
+
+	if(make_room) {
+		CHECK(fs.erase(dir, "spare") == FS_STATUS_OK);
+		CHECK(fs.flush(file) == FS_STATUS_OK);
+		CHECK(file.write_buffered == 0);
+		CHECK(fs.close(file) == FS_STATUS_OK);
+	} else {
+		CHECK(fs.close(file) == FS_STATUS_DISK_FULL);
+	}
+
+	remount();
+	check_file("full", make_room ? written : on_chip);
+	finish();
+}
+
+/*
+ * A second volume on another part at 0x57, mounted after the first: the
+ * driver keeps the page size and tWC of each chip, so the writes to both
+ * interleaved land whole
+ */
+
+static void two_parts() {
+
+	const DEVICE_PROFILE* other_profile = profile == &DEVICE_24LC256 ? &DEVICE_24LC64 : &DEVICE_24LC256;
+
+	EepromSim   other_chip(0x57, *other_profile, 0);
+	I2CFS       other;
+	DIR_HANDLE  dir;
+	DIR_HANDLE  other_dir;
+	FILE_HANDLE file;
+	FILE_HANDLE other_file;
+	uint32_t    done;
+
+	start("two parts mounted together");
+
+	if(!other_chip.attach(0)) exit(1);
+	sim_attach(&other_chip);
+
+	other.begin(0x57, *other_profile);
+	CHECK(other.format(other_profile->size / 1024) == FS_STATUS_OK);
+
+	fs.open_directory("/", dir);
+	other.open_directory("/", other_dir);
+	CHECK(fs.open("a", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	CHECK(other.open("b", MODE_WRITE, other_dir, other_file) == FS_STATUS_OK);
+
+	for(uint32_t at = 0; at < 3000; at += 100) {
+		fs.write(file, pattern + at, 100, &done);
+		other.write(other_file, pattern + at, 100, &done);
+	}
+
+	fs.close(file);
+	other.close(other_file);
+
+	remount();
+	other.begin(0x57, *other_profile);
+	check_file("a", 3000);
+	check_file("b", 3000, other);
+
+	sim_detach(&other_chip);
+	finish();
+}
+
+/*
+ * Directories: names are checked, renames and deletes show after a
+ * remount and a deleted directory gives back its blocks and its files'
+ */
+
+static void directories() {
+
+	DIR_HANDLE  dir;
+	DIR_ENTRY   dir_entry;
+	FILE_ENTRY  file_entry;
+	uint16_t    count = 0;
+
+	start("directories");
+	BLOCK empty = used_blocks();
+
+	CHECK(fs.create_directory("/logs") == FS_STATUS_OK);
+	CHECK(fs.create_directory("/logs") == FS_STATUS_DUPLICATED_FILE_NAME);
+	CHECK(fs.create_directory("logs")  == FS_STATUS_INVALID_FILE_NAME);
+	CHECK(fs.create_directory("/data") == FS_STATUS_OK);
+	BLOCK two_dirs = used_blocks();
+
+	CHECK(fs.open_directory("/logs", dir) == FS_STATUS_OK);
+	CHECK(write_file(dir, "a", 100) == FS_STATUS_OK);
+	CHECK(write_file(dir, "b", 500) == FS_STATUS_OK);
+	CHECK(write_file(dir, "c", 7)   == FS_STATUS_OK);
+
+	fs.find_first_file(dir);
+	while(fs.find_next_file(dir, file_entry) == FS_STATUS_OK) count++;
+	CHECK(count == 3);
+
+	CHECK(fs.rename_directory(dir, "/data") == FS_STATUS_DUPLICATED_FILE_NAME);
+	CHECK(fs.rename_directory(dir, "/old")  == FS_STATUS_OK);
+
+	remount();
+	CHECK(fs.open_directory("/logs", dir) == FS_STATUS_NOT_FOUND);
+	check_file("b", 500, fs, "/old");
+
+	count = 0;
+	fs.find_first_dir();
+	while(fs.find_next_dir(dir_entry) == FS_STATUS_OK) count++;
+	CHECK(count == 2);
+
+	CHECK(fs.delete_directory("/old") == FS_STATUS_OK);
+	CHECK(fs.delete_directory("/old") == FS_STATUS_NOT_FOUND);
+	CHECK(used_blocks() == two_dirs - 1);
+
+	remount();
+	CHECK(fs.open_directory("/old", dir) == FS_STATUS_NOT_FOUND);
+	CHECK(fs.delete_directory("/data") == FS_STATUS_OK);
+	CHECK(used_blocks() == empty);
+	finish();
+}
+
+/*
+ * Erasing or truncating a file gives back all its blocks and leaves its
+ * neighbours in the chain untouched
+ */
+
+static void erase() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	FILE_ENTRY  file_entry;
+
+	start("erase and truncate");
+	BLOCK empty = used_blocks();
+	fs.open_directory("/", dir);
+
+	CHECK(write_file(dir, "c", 500) == FS_STATUS_OK);
+	BLOCK only_c = used_blocks();
+
+	CHECK(write_file(dir, "a", 3000) == FS_STATUS_OK);
+	CHECK(write_file(dir, "b", 5)    == FS_STATUS_OK);
+
+	CHECK(fs.erase(dir, "a") == FS_STATUS_OK);
+	CHECK(fs.erase(dir, "a") == FS_STATUS_NOT_FOUND);
+	CHECK(fs.find_file(dir, "a", file_entry) == FS_STATUS_NOT_FOUND);
+	CHECK(fs.erase(dir, "b") == FS_STATUS_OK);
+	CHECK(used_blocks() == only_c);
+
+	remount();
+	CHECK(used_blocks() == only_c);
+	check_file("c", 500);
+
+	CHECK(fs.open("c", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	CHECK(file.size == 0);
+	fs.close(file);
+	CHECK(used_blocks() == empty + 1);
+
+	remount();
+	check_file("c", 0);
+	finish();
+}
+
+/*
+ * Power lost with a file open and the block cache not written back:
+ * begin() rebuilds the free space from the chains, so the blocks found
+ * are freed again by erase and a file filling the disk spares the file
+ * closed before
+ */
+
+static void recover() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	FILE_ENTRY  file_entry;
+	uint32_t    done;
+	uint32_t    written = 0;
+	FS_STATUS   status  = FS_STATUS_OK;
+
+	start("recover after power loss");
+	fs.open_directory("/", dir);
+
+	CHECK(write_file(dir, "keep", 2000) == FS_STATUS_OK);
+	BLOCK with_keep = used_blocks();
+
+	// On a clean volume recover() finds what the counters hold
+
+	CHECK(fs.recover() == FS_STATUS_OK);
+	CHECK(used_blocks() == with_keep);
+
+	CHECK(fs.create_directory("/tmp") == FS_STATUS_OK);
+	CHECK(fs.open_directory("/tmp", dir) == FS_STATUS_OK);
+	CHECK(write_file(dir, "x", 1000) == FS_STATUS_OK);
+	CHECK(fs.open("y", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	fs.write(file, pattern, 1500, &done);
+
+	power_loss();
+	check_file("keep", 2000);
+
+	if(fs.open_directory("/tmp", dir) == FS_STATUS_OK) {
+		CHECK(fs.delete_directory(dir) == FS_STATUS_OK);
+	}
+
+	fs.open_directory("/", dir);
+	CHECK(fs.find_file(dir, "keep", file_entry) == FS_STATUS_OK);
+	CHECK(used_blocks() == with_keep);
+
+	CHECK(fs.open("fill", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	while(status == FS_STATUS_OK) {
+		done     = 0;
+		status   = write_pattern(file, written, 1000, &done);
+		written += done;
+	}
+	fs.close(file);
+
+	CHECK(status == FS_STATUS_DISK_FULL);
+	CHECK(used_blocks() == fs.master_block.total_blocks);
+
+	remount();
+	check_file("keep", 2000);
+	check_file("fill", written);
+	finish();
+}
+
+/*
+ * Power lost after flush() with a file of several blocks still open: the
+ * file comes back with the bytes flushed and an append goes after them
+ */
+
+static void flushed_power_loss() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	uint32_t    done;
+
+	start("power loss after flush()");
+	fs.open_directory("/", dir);
+
+	CHECK(fs.open("f", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	fs.write(file, pattern, 500, &done);
+	CHECK(fs.flush(file) == FS_STATUS_OK);
+
+	power_loss();
+	check_file("f", 500);
+
+	CHECK(fs.open("f", MODE_APPEND, dir, file) == FS_STATUS_OK);
+	fs.write(file, pattern + 500, 100, &done);
+	fs.close(file);
+
+	remount();
+	check_file("f", 600);
+	finish();
+}
+
+/*
+ * A file block whose size runs past its chain, as when power is lost
+ * before the links of its last blocks reached the chip: recovery cuts the
+ * size to the blocks found, so reads and appends agree on where it ends
+ */
+
+static void size_past_chain() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	FILE_ENTRY  file_entry;
+	uint32_t    done;
+
+	start("recover a size past the chain");
+	fs.open_directory("/", dir);
+	CHECK(write_file(dir, "f", 500) == FS_STATUS_OK);
+	CHECK(fs.find_file(dir, "f", file_entry) == FS_STATUS_OK);
+
+	uint32_t in_blocks = file_entry.num_data_blocks * DATA_SIZE;
+
+	fs.read_block_type_file(file_entry.this_block);
+	fs.block.file.size = 5000;
+	fs.write_block_type_file(file_entry.this_block);
+	fs.touch_master_block();
+	fs.flush();
+
+	power_loss();
+	CHECK(fs.find_file(dir, "f", file_entry) == FS_STATUS_OK);
+	CHECK(file_entry.size == in_blocks);
+
+	CHECK(fs.open("f", MODE_READ, dir, file) == FS_STATUS_OK);
+	CHECK(fs.read(file, buffer, sizeof(buffer), &done) == FS_STATUS_END_OF_FILE);
+	CHECK(done == in_blocks);
+	CHECK(!memcmp(buffer, pattern, 500));
+	fs.close(file);
+
+	CHECK(fs.open("f", MODE_APPEND, dir, file) == FS_STATUS_OK);
+	fs.write(file, pattern, 100, &done);
+	fs.close(file);
+
+	remount();
+	CHECK(fs.open("f", MODE_READ, dir, file) == FS_STATUS_OK);
+	CHECK(file.size == in_blocks + 100);
+	fs.read(file, buffer, sizeof(buffer), &done);
+	CHECK(done == in_blocks + 100);
+	CHECK(!memcmp(buffer, pattern, 500));
+	CHECK(!memcmp(buffer + in_blocks, pattern, 100));
+	fs.close(file);
+	finish();
+}
+
+/*
+ * A file small enough stays in its file block, without data block, until
+ * appends spill it over to one. Reads and seeks see the same bytes either
+ * way
+ */
+
+static void inline_files() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	FILE_ENTRY  file_entry;
+	uint32_t    done;
+
+	start("inline files and spill");
+	BLOCK    empty = used_blocks();
+	uint16_t fits  = BLOCK_SIZE - offsetof(FileBlock, name) - sizeof("s");
+
+	fs.open_directory("/", dir);
+	CHECK(write_file(dir, "s", fits) == FS_STATUS_OK);
+	CHECK(fs.find_file(dir, "s", file_entry) == FS_STATUS_OK);
+	CHECK(!(file_entry.attributes & FS_ATTR_INLINE) == !I2CFS_INLINE_FILES);
+	if(I2CFS_INLINE_FILES) CHECK(used_blocks() == empty + 1);
+
+	remount();
+	check_file("s", fits);
+
+	CHECK(fs.open("s", MODE_READ, dir, file) == FS_STATUS_OK);
+	CHECK(fs.seek(file, fits / 2) == FS_STATUS_OK);
+	memset(buffer, 0, fits);
+	fs.read(file, buffer, fits, &done);
+	CHECK(done == (uint32_t)(fits - fits / 2));
+	CHECK(!memcmp(buffer, pattern + fits / 2, done));
+	fs.close(file);
+
+	// Reads up to a delimiter with the high bit set stop right after it
+
+	if(fits >= 3) {
+		uint8_t text[3] = { 'a', 0x9A, 'b' };
+
+		CHECK(fs.open("t", MODE_WRITE, dir, file) == FS_STATUS_OK);
+		fs.write(file, text, sizeof(text), &done);
+		fs.close(file);
+
+		CHECK(fs.open("t", MODE_READ, dir, file) == FS_STATUS_OK);
+		CHECK(fs.read(file, buffer, sizeof(text), &done, (char) 0x9A) == FS_STATUS_OK);
+		CHECK(done == 2);
+		CHECK(fs.read(file, buffer, sizeof(text), &done, (char) 0x9A) == FS_STATUS_END_OF_FILE);
+		CHECK(done == 1 && buffer[0] == 'b');
+		fs.close(file);
+		CHECK(fs.erase(dir, "t") == FS_STATUS_OK);
+	}
+
+	// Appends of a few bytes spill it over to data blocks
+
+	CHECK(fs.open("s", MODE_APPEND, dir, file) == FS_STATUS_OK);
+	for(uint32_t at = fits; at < fits + 3 * DATA_SIZE; at += 7) {
+		fs.write(file, pattern + at, 7, &done);
+	}
+	fs.close(file);
+
+	CHECK(fs.find_file(dir, "s", file_entry) == FS_STATUS_OK);
+	CHECK(!(file_entry.attributes & FS_ATTR_INLINE));
+	CHECK(file_entry.first_data_block != 0);
+
+	uint32_t size = file_entry.size;
+
+	remount();
+	check_file("s", size);
+	CHECK(fs.erase(dir, "s") == FS_STATUS_OK);
+	CHECK(used_blocks() == empty);
+	finish();
+}
+
+/*
+ * Reads up to a delimiter with the high bit set stop right after it, in
+ * a file of data blocks
+ */
+
+static void delimiter() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	uint8_t     text[300];
+	uint32_t    done;
+
+	start("read up to a 0x9A delimiter");
+
+	memset(text, 'a', sizeof(text));
+	text[150] = 0x9A;
+	text[250] = 0x9A;
+
+	fs.open_directory("/", dir);
+	CHECK(fs.open("text", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	fs.write(file, text, sizeof(text), &done);
+	fs.close(file);
+
+	remount();
+	CHECK(fs.open("text", MODE_READ, dir, file) == FS_STATUS_OK);
+
+	CHECK(fs.read(file, buffer, sizeof(text), &done, (char) 0x9A) == FS_STATUS_OK);
+	CHECK(done == 151);
+	CHECK(buffer[150] == 0x9A);
+	CHECK(fs.read(file, buffer, sizeof(text), &done, (char) 0x9A) == FS_STATUS_OK);
+	CHECK(done == 100);
+	CHECK(fs.read(file, buffer, sizeof(text), &done, (char) 0x9A) == FS_STATUS_END_OF_FILE);
+	CHECK(done == 49);
+
+	fs.close(file);
+	finish();
+}
+
+/*
+ * Seeks in any order land on the right byte of a file of many blocks,
+ * with or without the seek points a handle keeps
+ */
+
+static void seek_points() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	uint32_t    size = profile->size / 2;
+	uint32_t    done;
+
+	start("seeks across a large file");
+	fs.open_directory("/", dir);
+	CHECK(write_file(dir, "big", size) == FS_STATUS_OK);
+
+	remount();
+	CHECK(fs.open("big", MODE_READ, dir, file) == FS_STATUS_OK);
+
+	for(uint32_t i = 0; i < 300 && passed; i++) {
+
+		uint32_t at = i % 3 ? (i * 7919) % size : size - 1 - (i * 13) % size;
+		uint8_t  bytes[16];
+
+		CHECK(fs.seek(file, at) == FS_STATUS_OK);
+		done = 0;
+		fs.read(file, bytes, sizeof(bytes), &done);
+		CHECK(done == min((uint32_t) sizeof(bytes), size - at));
+		for(uint32_t k = 0; k < done; k++) CHECK(bytes[k] == pattern[(at + k) % sizeof(pattern)]);
+	}
+
+	CHECK(fs.seek(file, size)     == FS_STATUS_OK);
+	CHECK(fs.seek(file, size + 1) == FS_STATUS_INVALID_SEEK);
+	fs.close(file);
+	finish();
+}
+
+/*
+ * Lookups by name in several directories holding the same names, after
+ * renames and erases and after a remount builds any name table again
+ */
+
+static void names() {
+
+	DIR_HANDLE dir;
+	FILE_ENTRY file_entry;
+	char       name[8];
+
+	const char* dirs[] = { "/d0", "/d1", "/d2" };
+
+	start("lookups by name");
+
+	for(uint8_t d = 0; d < 3; d++) {
+		CHECK(fs.create_directory(dirs[d]) == FS_STATUS_OK);
+		fs.open_directory(dirs[d], dir);
+		for(uint8_t i = 0; i < 12; i++) {
+			sprintf(name, "f%u", i);
+			CHECK(write_file(dir, name, d * 20 + i + 1) == FS_STATUS_OK);
+		}
+	}
+
+	fs.open_directory("/d1", dir);
+	CHECK(fs.erase(dir, "f3") == FS_STATUS_OK);
+	CHECK(fs.rename_directory(dir, "/r1") == FS_STATUS_OK);
+	CHECK(write_file(dir, "new", 9) == FS_STATUS_OK);
+
+	dirs[1] = "/r1";
+
+	for(uint8_t pass = 0; pass < 2; pass++) {
+
+		for(uint8_t d = 0; d < 3; d++) {
+			CHECK(fs.open_directory(dirs[d], dir) == FS_STATUS_OK);
+			for(uint8_t i = 0; i < 12; i++) {
+				sprintf(name, "f%u", i);
+				if(d == 1 && i == 3) {
+					CHECK(fs.find_file(dir, name, file_entry) == FS_STATUS_NOT_FOUND);
+					continue;
+				}
+				CHECK(fs.find_file(dir, name, file_entry) == FS_STATUS_OK);
+				CHECK(file_entry.size == (uint32_t)(d * 20 + i + 1));
+			}
+		}
+
+		CHECK(fs.open_directory("/d1", dir) == FS_STATUS_NOT_FOUND);
+		fs.open_directory("/r1", dir);
+		CHECK(fs.find_file(dir, "new", file_entry) == FS_STATUS_OK);
+		fs.open_directory("/d0", dir);
+		CHECK(fs.find_file(dir, "new", file_entry) == FS_STATUS_NOT_FOUND);
+
+		remount();
+	}
+
+	finish();
+}
+
+/*
+ * A volume striped across two chips: blocks go to both and a remount
+ * reads the file back whole
+ */
+
+static void striping() {
+
+	EepromSim*  parts[2];
+	I2CFS       striped;
+	DIR_HANDLE  dir;
+
+	start("striped across two chips");
+	sim_detach(chip);
+
+	for(uint8_t i = 0; i < 2; i++) {
+		parts[i] = new EepromSim(0x50 + i, DEVICE_24LC64, 0);
+		if(!parts[i]->attach(0)) exit(1);
+		sim_attach(parts[i]);
+	}
+
+	striped.begin(0x50, DEVICE_24LC64, 2);
+	CHECK(striped.format(2 * DEVICE_24LC64.size / 1024) == FS_STATUS_OK);
+	striped.open_directory("/", dir);
+	CHECK(write_file(dir, "s", 10000, striped) == FS_STATUS_OK);
+
+	striped.begin(0x50, DEVICE_24LC64, 2);
+	check_file("s", 10000, striped);
+
+	for(uint8_t i = 0; i < 2; i++) {
+		uint32_t written = 0;
+		for(uint32_t at = 0; at < parts[i]->size; at++) written += parts[i]->mem[at] != 0xFF;
+		CHECK(written > 4000);
+		sim_detach(parts[i]);
+		delete parts[i];
+	}
+
+	sim_attach(chip);
+	fs.begin(0x50, *profile);
+	finish();
+}
+
+/*
+ * The free list, bitmap or FAT give every block once: the used count
+ * follows the blocks files take through erases that leave holes, a full
+ * disk has them all in use and erasing everything gives them all back
+ */
+
+static void allocator() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	FILE_ENTRY  file_entry;
+	char        name[8];
+	uint32_t    done;
+	uint32_t    written = 0;
+	FS_STATUS   status  = FS_STATUS_OK;
+
+	start("block allocation");
+	BLOCK empty = used_blocks();
+	BLOCK total = fs.master_block.total_blocks;
+
+	fs.open_directory("/", dir);
+
+	for(uint8_t i = 0; i < 10; i++) {
+		sprintf(name, "f%u", i);
+		CHECK(write_file(dir, name, (i + 1) * DATA_SIZE + 1) == FS_STATUS_OK);
+	}
+
+	for(uint8_t i = 0; i < 10; i += 2) {
+		sprintf(name, "f%u", i);
+		CHECK(fs.erase(dir, name) == FS_STATUS_OK);
+	}
+
+	BLOCK expected = empty;
+	for(uint8_t i = 1; i < 10; i += 2) expected += 1 + (i + 2);
+	CHECK(used_blocks() == expected);
+
+	CHECK(fs.recover() == FS_STATUS_OK);
+	CHECK(used_blocks() == expected);
+
+	CHECK(fs.open("fill", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	while(status == FS_STATUS_OK) {
+		done     = 0;
+		status   = write_pattern(file, written, 333, &done);
+		written += done;
+	}
+	fs.close(file);
+
+	CHECK(status == FS_STATUS_DISK_FULL);
+	CHECK(used_blocks() == total);
+
+	remount();
+	check_file("fill", written);
+	CHECK(used_blocks() == total);
+
+	fs.find_first_file(dir);
+	while(fs.find_next_file(dir, file_entry) == FS_STATUS_OK) {
+		CHECK(fs.erase(dir, file_entry.name) == FS_STATUS_OK);
+		fs.find_first_file(dir);
+	}
+
+	CHECK(used_blocks() == empty);
+	remount();
+	CHECK(used_blocks() == empty);
+	finish();
+}
+
+/*
+ * The chip takes its real write cycle: poll() reports the queued writes
+ * until they are all done, then calls back. A build without a queue
+ * writes before write() returns and poll() has nothing left
+ */
+
+static uint16_t write_callbacks;
+
+static void count_callback() {
+	write_callbacks++;
+}
+
+static void write_queue() {
+
+	DIR_HANDLE  dir;
+	FILE_HANDLE file;
+	uint32_t    done;
+	uint32_t    polls = 0;
+
+	start("writes drained by poll()");
+	chip->write_cycle_us = profile->write_cycle_ms * 1000;
+	write_callbacks      = 0;
+	fs.set_write_callback(count_callback);
+
+	fs.open_directory("/", dir);
+	CHECK(fs.open("q", MODE_WRITE, dir, file) == FS_STATUS_OK);
+	for(uint32_t at = 0; at < 3000; at += 50) fs.write(file, pattern + at, 50, &done);
+	fs.close(file);
+
+	while(fs.poll() == FS_STATUS_PENDING && polls++ < 100000) delay(1);
+	CHECK(fs.poll() == FS_STATUS_OK);
+
+	#if defined(I2C_WRITE_QUEUE) && I2C_WRITE_QUEUE
+	CHECK(write_callbacks > 0);
+	#endif
+
+	remount();
+	check_file("q", 3000);
+
+	fs.set_write_callback(0);
+	chip->write_cycle_us = 0;
+	finish();
+}
+
+// ---------------------------------------------------------------------------------------------
+
+static void usage() {
+	fprintf(stderr, "usage: i2cfs_test [-d device]\n");
+	sim_list_profiles();
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:")) != -1) {
+		switch(opt) {
+			case 'd': if(!(profile = sim_profile(optarg))) usage(); break;
+			default : usage();
+		}
+	}
+
+	for(uint16_t i = 0; i < sizeof(pattern); i++) pattern[i] = (uint8_t)(i * 31 + (i >> 8));
+
+	chip = new EepromSim(0x50, *profile, 0);
+	if(!chip->attach(0)) return 1;
+	sim_attach(chip);
+
+	Wire.begin();
+	fs.begin(0x50, *profile);
+
+	printf("i2cfs_test: %lu KB, %u byte blocks\n", (unsigned long) profile->size / 1024, BLOCK_SIZE);
+
+	disk_full("disk full, 7 byte writes",               7);
+	disk_full("disk full, 100 byte writes",             100);
+	disk_full("disk full, one write",                   sizeof(pattern));
+
+	disk_full_buffered("disk full, buffered, closed",     7,  200, false);
+	disk_full_buffered("disk full, buffered, room made",  13, 100, true);
+	disk_full_buffered("disk full, small buffer, closed", 5,  20,  false);
+	disk_full_buffered("disk full, small buffer, room",   30, 20,  true);
+
+	two_parts();
+	directories();
+	erase();
+	recover();
+	flushed_power_loss();
+	size_past_chain();
+	inline_files();
+	delimiter();
+	seek_points();
+	names();
+	striping();
+	allocator();
+	write_queue();
+
+	sim_detach(chip);
+	delete chip;
+
+	if(failed) printf("\n%d FAILED\n", failed);
+	return failed ? 1 : 0;
+}
@@ -3,16 +3,71 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef DRIVER_SPI
+#include "spiutils.h"
+#else
 #include "i2cutils.h"
+#endif
 
 I2CFS::I2CFS():last_acessed(0)
 {
+	#if I2CFS_CACHE_BLOCKS
+	cache_invalidate();
+	#endif
 }
 
-void I2CFS::begin(uint8_t addr) {
-	i2c_addr = addr;
+void I2CFS::begin(uint8_t addr, const DEVICE_PROFILE& profile, uint8_t chips) {
+	flush();
+	#if I2CFS_CACHE_BLOCKS
+	cache_invalidate();
+	#endif
+	i2c_addr       = addr;
+	device_chips   = chips ? min(chips, 8) : 1;
+
+	// The next chip is at the next device address that leaves the block
+	// select bits of the part clear. On I2C the chips that would fall
+	// outside the eight addresses of addr (0x50 to 0x57) are left out
+
+	chip_addr[0] = addr;
+	for(uint8_t i = 1; i < device_chips; i++) {
+		uint8_t next = ((chip_addr[i - 1] | profile.select_bits) + 1) & ~profile.select_bits;
+		#ifdef DRIVER_I2C
+		if((next ^ addr) & ~0x07) {
+			device_chips = i;
+			break;
+		}
+		#endif
+		chip_addr[i] = next;
+	}
+
+	device_blocks  = profile.size / BLOCK_SIZE * device_chips;
+
+	master_changes = 0;
+	for(uint8_t i = 0; i < device_chips; i++) driver_set_profile(chip_addr[i], profile);
     read_master_block();
+
+    #if I2CFS_FREE_BITMAP
+    read_bitmap();
+    #endif
+
+    #if I2CFS_FAT_TABLE
+    read_fat();
+    #endif
+
+    // Power was lost with allocations not synced: the free list and the
+    // used count on the chip can not be trusted
+
+    if((master_block.flags & FS_FLAG_DIRTY) &&
+       master_block.total_blocks &&
+       master_block.total_blocks <= device_blocks) {
+        recover();
+    }
+
+    #if I2CFS_NAME_TABLE
+    build_name_table();
+    #endif
 }
 /*
  * Format 
@@ -23,79 +78,767 @@ void I2CFS::clear_temp_block() {
 }
 
 bool I2CFS::read_master_block() { 
-	i2c_read_buffer(i2c_addr, 0, (uint8_t*) &master_block, sizeof(MasterBlock));
+	bool done = driver_read(i2c_addr, 0, (uint8_t*) &master_block, sizeof(MasterBlock));
 	IF_SERIAL_DEBUG(master_block.print('R'));
+	return done;
 }
 
 bool I2CFS::save_master_block() { 
-	i2c_write_buffer(i2c_addr, 0, (uint8_t*) &master_block, sizeof(MasterBlock));
+	bool done = driver_write(i2c_addr, 0, (uint8_t*) &master_block, sizeof(MasterBlock));
 	IF_SERIAL_DEBUG(master_block.print('W'));
+	return done;
+}
+
+void I2CFS::touch_master_block() {
+
+    // Allocation counters stay in RAM until sync(). The first change after
+    // a sync marks the master block dirty on the chip, so begin() knows
+    // when they have to be rebuilt
+
+    if(!(master_block.flags & FS_FLAG_DIRTY)) {
+        master_block.flags |= FS_FLAG_DIRTY;
+        save_master_block();
+        if(device_chips > 1) driver_wait();
+        master_changed_at = millis();
+    }
+
+    if(master_changes < 255) master_changes++;
+}
+
+void I2CFS::sync_if_due() {
+
+    if(!master_changes) return;
+
+    if((master_changes >= I2CFS_SYNC_OPS) ||
+       (I2CFS_SYNC_MS && (millis() - master_changed_at >= I2CFS_SYNC_MS))) {
+        sync();
+    }
+}
+
+FS_STATUS I2CFS::sync() {
+
+    I2CFS_TRACE_EVENT(TRACE_SYNC, 0, 0, master_changes)
+
+    flush();
+
+    #if I2CFS_FREE_BITMAP
+    save_bitmap();
+    #endif
+
+    // Writes to one chip reach it in order. Those to the other chips of a
+    // striped volume may still be queued or in their write cycle, the
+    // clean flag must not land before them
+
+    if(device_chips > 1) driver_wait();
+
+    if(master_block.flags & FS_FLAG_DIRTY) {
+        master_block.flags &= ~FS_FLAG_DIRTY;
+        save_master_block();
+    }
+
+    master_changes = 0;
+    return FS_STATUS_OK;
+}
+
+FS_STATUS I2CFS::poll() {
+    return driver_poll() ? FS_STATUS_OK : FS_STATUS_PENDING;
+}
+
+void I2CFS::set_write_callback(void (*callback)()) {
+    driver_set_callback(callback);
+}
+
+void I2CFS::mark_block(uint8_t* map, BLOCK block_num) {
+    map[block_num >> 3] |= 1 << (block_num & 7);
+}
+
+bool I2CFS::block_marked(uint8_t* map, BLOCK block_num) {
+    return map[block_num >> 3] & (1 << (block_num & 7));
+}
+
+FS_STATUS I2CFS::recover() {
+
+    #ifdef READ_ONLY
+
+    return FS_STATUS_ACESS_DENIED;
+
+    #else
+
+    BLOCK    total    = master_block.total_blocks;
+    BLOCK    used     = 1;
+
+    #if I2CFS_FREE_BITMAP
+
+    // The bitmap itself is rebuilt, blocks 0.. hold the master and it
+
+    if(((total + 7) >> 3) > I2CFS_FREE_BITMAP) return FS_STATUS_DISK_FULL;
+
+    uint8_t* used_map = bitmap;
+    memset(bitmap, 0, sizeof(bitmap));
+    for(BLOCK i = 1; i <= bitmap_blocks(); i++, used++) mark_block(used_map, i);
+
+    #else
+
+    #if I2CFS_FAT_TABLE
+    if(total * sizeof(BLOCK) > I2CFS_FAT_TABLE) return FS_STATUS_DISK_FULL;
+    #endif
+
+    uint8_t* used_map = (uint8_t*) calloc((total + 7) >> 3, 1);
+
+    if(!used_map) return FS_STATUS_DISK_FULL;
+
+    #if I2CFS_FAT_TABLE
+    for(BLOCK i = 1; i <= fat_blocks(); i++, used++) mark_block(used_map, i);
+    #endif
+
+    #endif
+
+    IF_SERIAL_DEBUG(pdebug_P(PSTR("recover: begin\n")))
+
+    flush();
+    mark_block(used_map, 0);
+
+    // Walks stop at a block out of range or already seen, so a chain
+    // left half written can not loop
+
+    BLOCK    next = master_block.first_directory_block;
+    BLOCK    dirs = 0;
+
+    while(next && next < total && !block_marked(used_map, next)) {
+        mark_block(used_map, next);
+        used++;
+        dirs++;
+        read_block_type_dir(next);
+        next = block.directory.next_dir_block;
+    }
+
+    // Files hang from the chains of the root and of each directory found
+
+    BLOCK dir = 0;
+
+    for(BLOCK d = 0; d <= dirs; d++) {
+
+        for(uint8_t bucket = 0; bucket < I2CFS_DIR_BUCKETS; bucket++) {
+
+            BLOCK file = bucket_head(dir, bucket);
+
+            while(file && file < total && !block_marked(used_map, file)) {
+
+                mark_block(used_map, file);
+                used++;
+                read_block_type_file(file);
+
+                BLOCK    this_file = file;
+                BLOCK    last      = 0;
+                uint32_t count     = 0;
+                uint32_t counted   = block.file.num_data_blocks;
+                BLOCK    last_kept = block.file.last_data_block;
+                uint32_t size_kept = block.file.size;
+                bool     in_block  = block.file.attributes & FS_ATTR_INLINE;
+
+                file = block.file.next_file_block;
+                next = block.file.first_data_block;
+
+                while(next && next < total && !block_marked(used_map, next)) {
+                    mark_block(used_map, next);
+                    used++;
+                    count++;
+                    last = next;
+                    next = get_link(next);
+                }
+
+                // Truncate and erase trust the block count and the last
+                // block of the file, they must match the chain walked. A
+                // size past the end of the chain would have reads stop
+                // short of it and appends go on from it
+
+                uint32_t size = in_block ? size_kept : min(size_kept, count * DATA_SIZE);
+
+                if(count != counted || last != last_kept || size != size_kept) {
+                    read_block_type_file(this_file);
+                    block.file.num_data_blocks = count;
+                    block.file.last_data_block = last;
+                    block.file.size            = size;
+                    write_block_type_file(this_file);
+                }
+            }
+        }
+
+        if(d) read_block_ex(dir, offsetof(DirectoryBlock, next_dir_block), &dir, sizeof(BLOCK));
+        else  dir = master_block.first_directory_block;
+    }
+
+    #if I2CFS_FREE_BITMAP
+
+    bitmap_dirty_from = 0;
+    bitmap_dirty_to   = (total + 7) >> 3;
+
+    #elif I2CFS_FAT_TABLE
+
+    // Blocks not reached are free, those reached keep their links
+
+    for(BLOCK i = 1; i < total; i++) {
+        if(!block_marked(used_map, i)) fat[i] = 0;
+        else if(!fat[i])               fat[i] = FAT_END;
+    }
+
+    fat_dirty_from = 0;
+    fat_dirty_to   = total * sizeof(BLOCK);
+
+    free(used_map);
+
+    #else
+
+    // Blocks above the last one reached are fresh again, the others not
+    // reached are free, linked in block order
+
+    BLOCK fresh = total;
+    while(fresh > 1 && !block_marked(used_map, fresh - 1)) fresh--;
+
+    master_block.next_fresh_block = fresh < total ? fresh : 0;
+    master_block.first_free_block = 0;
+
+    for(BLOCK i = fresh - 1; i; i--) {
+        if(block_marked(used_map, i)) continue;
+        block.free.next_free_block = master_block.first_free_block;
+        write_block_type_free(i);
+        master_block.first_free_block = i;
+    }
+
+    free(used_map);
+
+    #endif
+
+    master_block.used_blocks = used;
+    sync();
+
+    I2CFS_TRACE_EVENT(TRACE_RECOVER, total, 0, used)
+    IF_SERIAL_DEBUG(pdebug_P(PSTR("recover: end\n")))
+    return FS_STATUS_OK;
+
+    #endif
+}
+
+#if I2CFS_FREE_BITMAP
+
+/*
+ * Free space bitmap
+ *
+ * One bit per block, set when the block is in use, stored right after the
+ * master block and loaded whole by begin(). Allocating and releasing only
+ * flip bits in RAM; sync() writes back the bytes that changed.
+ */
+
+uint16_t I2CFS::bitmap_blocks() {
+    return (((master_block.total_blocks + 7) >> 3) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+void I2CFS::bitmap_set(BLOCK block_num, bool used) {
+
+    BLOCK byte = block_num >> 3;
+
+    if(used) bitmap[byte] |=   1 << (block_num & 7);
+    else     bitmap[byte] &= ~(1 << (block_num & 7));
+
+    if(bitmap_dirty_to == 0 || byte < bitmap_dirty_from) bitmap_dirty_from = byte;
+    if(byte >= bitmap_dirty_to)                         bitmap_dirty_to   = byte + 1;
+}
+
+uint8_t I2CFS::find_free_run(BLOCK& first, uint8_t wanted) {
+
+    // Searches from the cursor up, then wraps around, for the first run of
+    // wanted free blocks, or the longest one if none is that long. Whole
+    // bytes in use are skipped without testing their bits
+
+    BLOCK   total = master_block.total_blocks;
+    BLOCK   i     = bitmap_cursor < total ? bitmap_cursor : 1;
+    uint8_t best  = 0;
+
+    for(BLOCK left = total; left; ) {
+
+        if(!(i & 7) && bitmap[i >> 3] == 0xFF && left >= 8) {
+            i += 8; left -= 8;
+        } else if(block_marked(bitmap, i)) {
+            i++; left--;
+        } else {
+            uint8_t found = 1;
+            while(found < wanted && found < left && i + found < total && !block_marked(bitmap, i + found)) found++;
+            if(found > best) {
+                best  = found;
+                first = i;
+            }
+            if(found == wanted) break;
+            i += found; left -= found;
+        }
+
+        if(i >= total) i = 1;
+    }
+
+    return best;
+}
+
+BLOCK I2CFS::get_free_run(uint8_t wanted, uint8_t& got) {
+
+    BLOCK first;
+
+    got = find_free_run(first, wanted);
+    if(!got) return 0;
+
+    for(uint8_t i = 0; i < got; i++) bitmap_set(first + i, true);
+    bitmap_cursor = first + got;
+    master_block.used_blocks += got;
+
+    touch_master_block();
+    I2CFS_TRACE_EVENT(TRACE_ALLOC, first, 0, got)
+    return first;
+}
+
+bool I2CFS::read_bitmap() {
+
+    uint32_t bytes = ((uint32_t) master_block.total_blocks + 7) >> 3;
+
+    bitmap_dirty_to = 0;
+    bitmap_cursor   = 1;
+
+    if(!master_block.total_blocks || bytes > I2CFS_FREE_BITMAP) return false;
+    return device_read(1, 0, bitmap, bytes);
+}
+
+bool I2CFS::save_bitmap() {
+
+    if(!bitmap_dirty_to) return true;
+
+    bool done = device_write(1 + bitmap_dirty_from / BLOCK_SIZE,
+                             bitmap_dirty_from % BLOCK_SIZE,
+                             bitmap + bitmap_dirty_from,
+                             bitmap_dirty_to - bitmap_dirty_from);
+    if(done) bitmap_dirty_to = 0;
+    return done;
 }
 
-bool I2CFS::read_block(uint16_t block_num, uint16_t size) { 
-	uint32_t block_addr = block_num * 64;
-	i2c_read_buffer(i2c_addr, block_addr, (uint8_t*) &block.raw, size);	
+#endif
+
+#if I2CFS_FAT_TABLE
+
+/*
+ * Link table
+ *
+ * The link of every block, FAT style, stored right after the master block
+ * and loaded whole by begin(): ZERO for a free block, FAT_END for a block
+ * in use with no next one. Following a chain and finding a free block
+ * never touch the bus; sync() writes back the entries that changed.
+ */
+
+uint16_t I2CFS::fat_blocks() {
+    return ((uint32_t) master_block.total_blocks * sizeof(BLOCK) + BLOCK_SIZE - 1) / BLOCK_SIZE;
 }
 
-bool I2CFS::read_block_ex(uint16_t block_num, uint8_t offset, void* buffer, uint16_t size) { 
-	uint32_t block_addr = block_num * 64 + offset;
-	i2c_read_buffer(i2c_addr, block_addr, (uint8_t*) buffer, size);	
+void I2CFS::fat_set(BLOCK block_num, BLOCK entry) {
+
+    uint16_t from = block_num * sizeof(BLOCK);
+
+    fat[block_num] = entry;
+
+    if(fat_dirty_to == 0 || from < fat_dirty_from) fat_dirty_from = from;
+    if(from + sizeof(BLOCK) > fat_dirty_to)        fat_dirty_to   = from + sizeof(BLOCK);
 }
 
-bool I2CFS::write_block(uint16_t block_num, uint16_t size) { 
-	uint32_t block_addr = block_num * 64;
-	i2c_write_buffer(i2c_addr, block_addr, (uint8_t*) &block.raw, size);
+bool I2CFS::read_fat() {
+
+    uint32_t bytes = (uint32_t) master_block.total_blocks * sizeof(BLOCK);
+
+    fat_dirty_to = 0;
+    fat_cursor   = 1;
+
+    if(!master_block.total_blocks || bytes > I2CFS_FAT_TABLE) return false;
+    return device_read(1, 0, fat, bytes);
 }
 
-bool I2CFS::write_block_ex(uint16_t block_num, uint8_t offset, void* buffer, uint16_t size) { 
-	uint32_t block_addr = block_num * 64 + offset;
-	i2c_write_buffer(i2c_addr, block_addr, (uint8_t*) buffer, size);
+bool I2CFS::save_fat() {
+
+    if(!fat_dirty_to) return true;
+
+    bool done = device_write(1 + fat_dirty_from / BLOCK_SIZE,
+                             fat_dirty_from % BLOCK_SIZE,
+                             (uint8_t*) fat + fat_dirty_from,
+                             fat_dirty_to - fat_dirty_from);
+    if(done) fat_dirty_to = 0;
+    return done;
 }
 
-bool I2CFS::read_block_type_free(uint16_t block_num) { 
+#endif
+
+/*
+ * Link of a data block to the next one of its file, ZERO for the last
+ */
+
+BLOCK I2CFS::get_link(BLOCK block_num) {
+
+    #if I2CFS_FAT_TABLE
+
+    BLOCK next = fat[block_num];
+    return next == FAT_END ? 0 : next;
+
+    #else
+
+    BLOCK next;
+    read_block_ex(block_num, 0, &next, sizeof(BLOCK));
+    return next;
+
+    #endif
+}
+
+void I2CFS::set_link(BLOCK block_num, BLOCK next) {
+
+    #if I2CFS_FAT_TABLE
+    fat_set(block_num, next ? next : FAT_END);
+    #else
+    write_block_ex(block_num, 0, &next, sizeof(BLOCK));
+    #endif
+}
+
+/*
+ * On a volume of several chips block n is block n / chips of chip n % chips:
+ * consecutive blocks sit on different chips, so the write cycle of one runs
+ * while the next block goes out to another
+ */
+
+bool I2CFS::device_read(BLOCK block_num, BLOCK_OFFSET offset, void* buffer, uint16_t size) { 
+	uint8_t* pointer = (uint8_t*) buffer;
+
+	I2CFS_TRACE_EVENT(TRACE_READ, block_num, offset, size)
+
+	if(device_chips == 1) {
+		uint32_t block_addr = (uint32_t) block_num * BLOCK_SIZE + offset;
+		return driver_read(i2c_addr, block_addr, pointer, size);
+	}
+
+	while(size) {
+		uint16_t bytes      = min(size, BLOCK_SIZE - offset);
+		uint32_t block_addr = (uint32_t)(block_num / device_chips) * BLOCK_SIZE + offset;
+		if(!driver_read(chip_addr[block_num % device_chips], block_addr, pointer, bytes)) return false;
+		pointer  += bytes;
+		size     -= bytes;
+		offset    = 0;
+		block_num++;
+	}
+	return true;
+}
+
+bool I2CFS::device_write(BLOCK block_num, BLOCK_OFFSET offset, void* buffer, uint16_t size) { 
+	uint8_t* pointer = (uint8_t*) buffer;
+
+	I2CFS_TRACE_EVENT(TRACE_WRITE, block_num, offset, size)
+
+	if(device_chips == 1) {
+		uint32_t block_addr = (uint32_t) block_num * BLOCK_SIZE + offset;
+		return driver_write(i2c_addr, block_addr, pointer, size);
+	}
+
+	while(size) {
+		uint16_t bytes      = min(size, BLOCK_SIZE - offset);
+		uint32_t block_addr = (uint32_t)(block_num / device_chips) * BLOCK_SIZE + offset;
+		if(!driver_write(chip_addr[block_num % device_chips], block_addr, pointer, bytes)) return false;
+		pointer  += bytes;
+		size     -= bytes;
+		offset    = 0;
+		block_num++;
+	}
+	return true;
+}
+
+#if I2CFS_CACHE_BLOCKS
+
+/*
+ * Block cache
+ *
+ * Typed block reads and writes (read_block / write_block) go through a small
+ * LRU cache, so metadata read again hits RAM and several updates of one
+ * block cost a single page write. Payload transfers (read_block_ex /
+ * write_block_ex) use a cached copy when there is one and go straight to
+ * the chip otherwise, so streaming data does not evict the metadata.
+ */
+
+CacheEntry* I2CFS::cache_find(BLOCK block_num) {
+
+	for(uint8_t i = 0; i < I2CFS_CACHE_BLOCKS; i++) {
+		if(cache[i].block_num == block_num) return &cache[i];
+	}
+	return 0;
+}
+
+void I2CFS::cache_touch(CacheEntry* entry) {
+
+	for(uint8_t i = 0; i < I2CFS_CACHE_BLOCKS; i++) {
+		if(cache[i].rank < entry->rank) cache[i].rank++;
+	}
+	entry->rank = 0;
+}
+
+CacheEntry* I2CFS::cache_alloc(BLOCK block_num) {
+
+	CacheEntry* victim = &cache[0];
+
+	for(uint8_t i = 0; i < I2CFS_CACHE_BLOCKS; i++) {
+		if(!cache[i].block_num) {
+			victim = &cache[i];
+			break;
+		}
+		if(cache[i].rank > victim->rank) victim = &cache[i];
+	}
+
+	if(victim->block_num) cache_write_back(victim);
+
+	victim->block_num  = block_num;
+	victim->valid      = 0;
+	victim->dirty_from = 0;
+	victim->dirty_to   = 0;
+	victim->rank       = I2CFS_CACHE_BLOCKS;
+	cache_touch(victim);
+
+	return victim;
+}
+
+bool I2CFS::cache_fill(CacheEntry* entry, BLOCK_OFFSET upto) {
+
+	// Loads [valid, upto) from the chip without losing newer dirty bytes
+
+	if(upto <= entry->valid) return true;
+
+	BLOCK_OFFSET from = entry->valid;
+	uint8_t      tmp[BLOCK_SIZE];
+
+	if(!device_read(entry->block_num, from, tmp + from, upto - from)) return false;
+
+	for(BLOCK_OFFSET i = from; i < upto; i++) {
+		if(i < entry->dirty_from || i >= entry->dirty_to) entry->data[i] = tmp[i];
+	}
+
+	entry->valid = upto;
+	return true;
+}
+
+bool I2CFS::cache_write_back(CacheEntry* entry) {
+
+	if(!entry->dirty_to) return true;
+
+	BLOCK_OFFSET from = entry->dirty_from;
+	BLOCK_OFFSET to   = entry->dirty_to;
+
+	entry->dirty_from = 0;
+	entry->dirty_to   = 0;
+
+	return device_write(entry->block_num, from, entry->data + from, to - from);
+}
+
+void I2CFS::cache_invalidate() {
+	memset(cache, 0, sizeof(cache));
+}
+
+#endif
+
+FS_STATUS I2CFS::flush() {
+
+    #if I2CFS_CACHE_BLOCKS
+
+	for(uint8_t i = 0; i < I2CFS_CACHE_BLOCKS; i++) {
+		if(cache[i].block_num) cache_write_back(&cache[i]);
+	}
+
+	#endif
+
+	// The links of the data blocks live in the table, without them the
+	// data just written could not be found after a power loss
+
+	#if I2CFS_FAT_TABLE
+	save_fat();
+	#endif
+
+	return FS_STATUS_OK;
+}
+
+bool I2CFS::read_block(BLOCK block_num, uint16_t size) { 
+
+	#if I2CFS_CACHE_BLOCKS
+
+	CacheEntry* entry = cache_find(block_num);
+
+	if(entry) {
+		I2CFS_TRACE_EVENT(TRACE_CACHED, block_num, 0, size)
+	} else {
+		entry = cache_alloc(block_num);
+	}
+
+	if(!cache_fill(entry, size)) return false;
+	cache_touch(entry);
+	memcpy(block.raw, entry->data, size);
+	return true;
+
+	#else
+
+	return device_read(block_num, 0, block.raw, size);
+
+	#endif
+}
+
+bool I2CFS::read_block_ex(BLOCK block_num, BLOCK_OFFSET offset, void* buffer, uint16_t size) { 
+
+	#if I2CFS_CACHE_BLOCKS
+
+	CacheEntry* entry = cache_find(block_num);
+
+	if(entry) {
+		I2CFS_TRACE_EVENT(TRACE_CACHED, block_num, offset, size)
+		if(!cache_fill(entry, offset + size)) return false;
+		memcpy(buffer, entry->data + offset, size);
+		return true;
+	}
+
+	#endif
+
+	return device_read(block_num, offset, buffer, size);
+}
+
+bool I2CFS::write_block(BLOCK block_num, uint16_t size) { 
+
+	#if I2CFS_CACHE_BLOCKS
+
+	CacheEntry* entry = cache_find(block_num);
+	if(!entry) entry = cache_alloc(block_num);
+
+	cache_touch(entry);
+	return write_block_ex(block_num, 0, block.raw, size);
+
+	#else
+
+	return device_write(block_num, 0, block.raw, size);
+
+	#endif
+}
+
+bool I2CFS::write_block_ex(BLOCK block_num, BLOCK_OFFSET offset, void* buffer, uint16_t size) { 
+
+	#if I2CFS_CACHE_BLOCKS
+
+	CacheEntry* entry = cache_find(block_num);
+
+	if(entry) {
+
+		BLOCK_OFFSET from = offset;
+		BLOCK_OFFSET to   = offset + size;
+
+		if(entry->dirty_to) {
+
+			// Bytes between the old and the new dirty range go back too,
+			// they must be known first
+
+			BLOCK_OFFSET gap_to = 0;
+			if(from > entry->dirty_to)   gap_to = from;
+			else if(to < entry->dirty_from) gap_to = entry->dirty_from;
+			if(gap_to > entry->valid && !cache_fill(entry, gap_to)) return false;
+
+			if(entry->dirty_from < from) from = entry->dirty_from;
+			if(entry->dirty_to   > to)   to   = entry->dirty_to;
+		}
+
+		memcpy(entry->data + offset, buffer, size);
+		entry->dirty_from = from;
+		entry->dirty_to   = to;
+		if(from <= entry->valid && to > entry->valid) entry->valid = to;
+
+		cache_touch(entry);
+		return true;
+	}
+
+	#endif
+
+	return device_write(block_num, offset, buffer, size);
+}
+
+bool I2CFS::read_block_type_free(BLOCK block_num) { 
 	read_block(block_num, sizeof(FreeBlock));
 	IF_SERIAL_DEBUG(block.free.print('R', block_num));
+	return true;
 }
 
-bool I2CFS::write_block_type_free(uint16_t block_num) { 
+bool I2CFS::write_block_type_free(BLOCK block_num) { 
 	write_block(block_num, sizeof(FreeBlock));
 	IF_SERIAL_DEBUG(block.free.print('W', block_num));
+	return true;
 }
 
-bool I2CFS::read_block_type_file(uint16_t block_num) { 
+bool I2CFS::read_block_type_file(BLOCK block_num) { 
 	read_block(block_num, sizeof(FileBlock));
 	IF_SERIAL_DEBUG(block.file.print('R'));
+	return true;
 }
 
-bool I2CFS::write_block_type_file(uint16_t block_num) { 
+bool I2CFS::write_block_type_file(BLOCK block_num) { 
 	block.file.this_block = block_num;
 	write_block(block_num, sizeof(FileBlock));
 	IF_SERIAL_DEBUG(block.file.print('W'));
+	return true;
 }
 
-bool I2CFS::read_block_type_dir(uint16_t block_num) { 
+bool I2CFS::read_block_type_dir(BLOCK block_num) { 
 	read_block(block_num, sizeof(DirectoryBlock));
 	IF_SERIAL_DEBUG(block.directory.print('R'));
+	return true;
 }
 
-bool I2CFS::write_block_type_dir(uint16_t block_num) { 
+bool I2CFS::write_block_type_dir(BLOCK block_num) { 
 	block.directory.this_block = block_num;
 	write_block(block_num, sizeof(DirectoryBlock));
 	IF_SERIAL_DEBUG(block.directory.print('W'));
+	return true;
 }
 
-bool I2CFS::read_block_type_data(uint16_t block_num) { 
+bool I2CFS::read_block_type_data(BLOCK block_num) { 
 	read_block(block_num, sizeof(DataBlock));
 	IF_SERIAL_DEBUG(block.data.print('R', block_num));
+	return true;
 }
 
-bool I2CFS::write_block_type_data(uint16_t block_num) { 
+bool I2CFS::write_block_type_data(BLOCK block_num) { 
 	write_block(block_num, sizeof(DataBlock));
 	IF_SERIAL_DEBUG(block.data.print('W', block_num));
+	return true;
 }
 
 BLOCK I2CFS::get_one_free_block() { 
 
+	#if I2CFS_FREE_BITMAP
+
+	uint8_t got;
+
+	return get_free_run(1, got);
+
+	#elif I2CFS_FAT_TABLE
+
+	// Searches from the cursor up, then wraps around
+
+	BLOCK total = master_block.total_blocks;
+	BLOCK i     = fat_cursor < total ? fat_cursor : 1;
+
+	for(BLOCK left = total; left; left--) {
+
+		if(!fat[i]) {
+			fat_set(i, FAT_END);
+			fat_cursor = i + 1;
+			master_block.used_blocks++;
+
+			touch_master_block();
+			I2CFS_TRACE_EVENT(TRACE_ALLOC, i, 0, 1)
+			return i;
+		}
+
+		if(++i >= total) i = 1;
+	}
+
+	return 0;
+
+	#else
+
 	BLOCK free_block_num = master_block.first_free_block;
 
 	if (free_block_num) {
@@ -106,10 +849,55 @@ BLOCK I2CFS::get_one_free_block() {
 		master_block.first_free_block = next_free_block_num;
 		master_block.used_blocks++;
 
-		save_master_block();
+		touch_master_block();
+		I2CFS_TRACE_EVENT(TRACE_ALLOC, free_block_num, 0, 1)
 		return free_block_num;
 
 	}
+
+	// Free list exhausted: take the next block never used since format
+
+	free_block_num = master_block.next_fresh_block;
+
+	if (free_block_num && free_block_num < master_block.total_blocks) {
+
+		master_block.next_fresh_block = free_block_num + 1 < master_block.total_blocks ? 
+		                                free_block_num + 1 : 0;
+		master_block.used_blocks++;
+
+		touch_master_block();
+		I2CFS_TRACE_EVENT(TRACE_ALLOC, free_block_num, 0, 1)
+		return free_block_num;
+
+	}
+
+	return 0;
+
+	#endif
+}
+
+BLOCK I2CFS::get_data_block(BLOCK& run, uint8_t& run_left, uint32_t bytes) {
+
+	#if I2CFS_FREE_BITMAP
+
+	// A data block for the next bytes of an append. The blocks all of them
+	// need are taken as one run of consecutive blocks when there is one,
+	// and handed out from it in order
+
+	if(!run_left) {
+		uint32_t wanted = (bytes + DATA_SIZE - 1) / DATA_SIZE;
+		run = get_free_run(wanted < 255 ? wanted : 255, run_left);
+		if(!run_left) return 0;
+	}
+
+	run_left--;
+	return run++;
+
+	#else
+
+	return get_one_free_block();
+
+	#endif
 }
 
 void I2CFS::release_one_used_block(BLOCK used_block) { 
@@ -118,54 +906,223 @@ void I2CFS::release_one_used_block(BLOCK used_block) {
 
 	if(!used_block) return;
 
+    #if I2CFS_FREE_BITMAP
+    bitmap_set(used_block, false);
+    #elif I2CFS_FAT_TABLE
+    fat_set(used_block, 0);
+    #else
     block.free.next_free_block = master_block.first_free_block;
     write_block_type_free(used_block);
 
     master_block.first_free_block = used_block;
+    #endif
+
     master_block.used_blocks--;
-    save_master_block();
+    touch_master_block();
+    I2CFS_TRACE_EVENT(TRACE_RELEASE, used_block, 0, 1)
 
     #endif
 
 }
 
-void I2CFS::release_data_blocks(BLOCK first_block) { 
+void I2CFS::release_data_blocks(FILE_ENTRY& file_entry) { 
 
     #ifndef READ_ONLY
 
+    BLOCK first_block = file_entry.first_data_block;
+
 	if(!first_block) return;
 
+    I2CFS_TRACE_EVENT(TRACE_RELEASE, first_block, 0, file_entry.num_data_blocks)
+
+    #if I2CFS_FREE_BITMAP
+
+    // Only the links are read, each block is freed by clearing its bit
+
     BLOCK next_block = first_block;
-    BLOCK last_block = 0;
-    uint16_t released_blocks=0;
 
     while (next_block) {
+        bitmap_set(next_block, false);
+        master_block.used_blocks--;
+        read_block_ex(next_block, 0, &next_block, sizeof(BLOCK));
+    }
 
-    	last_block = next_block;
-    	released_blocks++;
-    	read_block_type_free(next_block);
-    	next_block = block.free.next_free_block;
+    touch_master_block();
 
+    #elif I2CFS_FAT_TABLE
+
+    // The chain is followed in the table, its entries are cleared
+
+    BLOCK next_block = first_block;
+
+    while (next_block) {
+        BLOCK this_block = next_block;
+        next_block       = get_link(this_block);
+        fat_set(this_block, 0);
+        master_block.used_blocks--;
     }
 
-    if(first_block == last_block) release_one_used_block(first_block);
-    else {
+    touch_master_block();
+
+    #else
 
-       // read_block_type_free(last_block); // It's in buffer
-       block.free.next_free_block = master_block.first_free_block;
-       write_block_type_free(last_block);
+    BLOCK    last_block      = file_entry.last_data_block;
+    uint32_t released_blocks = file_entry.num_data_blocks;
 
-       master_block.first_free_block = first_block;
-       master_block.used_blocks      -= released_blocks;
+    // Files written before the count was kept have it at ZERO, their
+    // chain is walked once to find it
 
-       save_master_block();
+    if(!released_blocks || !last_block) {
+
+        BLOCK next_block = first_block;
+        released_blocks  = 0;
+
+        while (next_block) {
+            last_block = next_block;
+            released_blocks++;
+            read_block_ex(next_block, 0, &next_block, sizeof(BLOCK));
+        }
     }
 
+    // Data and free blocks keep their link at the same offset, so the
+    // whole chain joins the free list by linking its tail
+
+    BLOCK first_free = master_block.first_free_block;
+    write_block_ex(last_block, 0, &first_free, sizeof(BLOCK));
+
+    master_block.first_free_block = first_block;
+    master_block.used_blocks     -= released_blocks;
+
+    touch_master_block();
+
+    #endif
+
     #endif
     
 }
 
+/*
+ * File chains
+ *
+ * The files of a directory hang from I2CFS_DIR_BUCKETS chains, chosen by
+ * a hash of the name, whose heads are kept in its DirectoryBlock, or in
+ * the master block for the root. Looking a name up reads only its chain.
+ */
+
+uint16_t I2CFS::name_hash(const char* name) {
+
+    uint16_t hash = 0;
+    while(*name) hash = hash * 31 + (uint8_t) *name++;
+    return hash;
+}
+
+uint8_t I2CFS::name_bucket(const char* name) {
+    return name_hash(name) % I2CFS_DIR_BUCKETS;
+}
+
+BLOCK I2CFS::bucket_head(BLOCK dir_block, uint8_t bucket) {
+
+    if(!dir_block) return master_block.root_files[bucket];
+
+    BLOCK head;
+    read_block_ex(dir_block, offsetof(DirectoryBlock, files) + bucket * sizeof(BLOCK), &head, sizeof(BLOCK));
+    return head;
+}
+
+void I2CFS::set_bucket_head(BLOCK dir_block, uint8_t bucket, BLOCK head) {
+
+    if(!dir_block) {
+        master_block.root_files[bucket] = head;
+        save_master_block();
+        return;
+    }
+
+    write_block_ex(dir_block, offsetof(DirectoryBlock, files) + bucket * sizeof(BLOCK), &head, sizeof(BLOCK));
+}
+
+#if I2CFS_NAME_TABLE
+
+/*
+ * Name table
+ *
+ * A hash, the parent and the block of every name on the volume, loaded by
+ * begin() and kept up to date by the calls that create, rename or erase.
+ * A lookup reads only the blocks whose hash matches. When the table ran
+ * out of room, names not found in it are looked up on the chip.
+ */
+
+void I2CFS::build_name_table() {
+
+    name_count     = 0;
+    names_complete = true;
+
+    if(!master_block.total_blocks || master_block.total_blocks > device_blocks) return;
+
+    BLOCK dir = 0;
+
+    do {
+
+        if(dir) {
+            read_block_type_dir(dir);
+            name_table_add(block.directory.name, dir, dir);
+        }
+
+        for(uint8_t bucket = 0; bucket < I2CFS_DIR_BUCKETS; bucket++) {
+            BLOCK file = bucket_head(dir, bucket);
+            while(file) {
+                read_block_type_file(file);
+                name_table_add(block.file.name, dir, file);
+                file = block.file.next_file_block;
+            }
+        }
+
+        if(dir) read_block_ex(dir, offsetof(DirectoryBlock, next_dir_block), &dir, sizeof(BLOCK));
+        else    dir = master_block.first_directory_block;
+
+    } while(dir);
+}
+
+void I2CFS::name_table_add(const char* name, BLOCK parent, BLOCK block_num) {
+
+    if(name_count == I2CFS_NAME_TABLE) {
+        names_complete = false;
+        return;
+    }
+
+    names[name_count].hash      = name_hash(name);
+    names[name_count].parent    = parent;
+    names[name_count].block_num = block_num;
+    name_count++;
+}
+
+void I2CFS::name_table_remove(BLOCK block_num) {
+
+    for(uint16_t i = 0; i < name_count; i++) {
+        if(names[i].block_num == block_num) {
+            names[i] = names[--name_count];
+            return;
+        }
+    }
+}
+
+#endif
+
 BLOCK I2CFS::find_dir_block_by_name(const char* name) {
+
+    #if I2CFS_NAME_TABLE
+
+    uint16_t hash = name_hash(name);
+
+    for(uint16_t i = 0; i < name_count; i++) {
+        NameEntry& entry = names[i];
+        if(entry.hash != hash || entry.parent != entry.block_num) continue;
+        read_block_type_dir(entry.block_num);
+        if(strcmp(name, block.directory.name) == 0) return entry.block_num;
+    }
+
+    if(names_complete) return 0;
+
+    #endif
     
 	BLOCK next_block = master_block.first_directory_block;
 
@@ -190,7 +1147,8 @@ bool I2CFS::is_valid_dir_name(const char * name) {
 
 	if((!strlen(name)) || 
        (*name != '/')  || 
-	   (strlen(name) == 1)) return false;
+	   (strlen(name) == 1) ||
+	   (strlen(name) >= sizeof(FILENAME))) return false;
 
 	return true;
 }
@@ -235,9 +1193,15 @@ FS_STATUS I2CFS::create_directory(const char* name) {
     block.directory.next_dir_block     = previous_dir_block_num;
     block.directory.previous_dir_block = 0;
     memcpy(block.directory.name, name, strlen(name) + 1);
+    memset(block.directory.files, 0, sizeof(block.directory.files));
 
     write_block_type_dir(new_block_num);
 
+    #if I2CFS_NAME_TABLE
+    name_table_add(name, new_block_num, new_block_num);
+    #endif
+    sync_if_due();
+
     return FS_STATUS_OK;
 
     #endif
@@ -259,7 +1223,7 @@ FS_STATUS I2CFS::open_directory(const char* name, DIR_HANDLE& dir_handle) {
        dir_handle.block_num = dir_block;
     }
 
-    dir_handle.next_file_block = master_block.first_file_block;
+    find_first_file(dir_handle);
 
     return FS_STATUS_OK;
 
@@ -284,9 +1248,14 @@ FS_STATUS I2CFS::rename_directory(DIR_HANDLE&  dir_handle, const char* new_name)
 	if(directory_exists(new_name))     return FS_STATUS_DUPLICATED_FILE_NAME;
 
 	read_block_type_dir(dir_handle.block_num);
-	strncpy(block.directory.name, new_name, 32);
+	memcpy(block.directory.name, new_name, strlen(new_name) + 1);
 	write_block_type_dir(dir_handle.block_num);
 
+	#if I2CFS_NAME_TABLE
+	name_table_remove(dir_handle.block_num);
+	name_table_add(new_name, dir_handle.block_num, dir_handle.block_num);
+	#endif
+
 	return FS_STATUS_OK;
 
 	#endif
@@ -304,6 +1273,8 @@ FS_STATUS I2CFS::delete_directory(const char* name) {
     if(open_directory(name, dir_handle) == FS_STATUS_OK)
         return delete_directory(dir_handle);
 
+    return FS_STATUS_NOT_FOUND;
+
     #endif
 }
 
@@ -321,12 +1292,12 @@ FS_STATUS I2CFS::delete_directory(DIR_HANDLE&  dir_handle) {
     find_first_file(dir_handle);
 
     while(find_next_file(dir_handle, file_entry) == FS_STATUS_OK) {
-        erase(dir_handle, file_entry.name);
+        erase_file_entry(file_entry);
     }
     
 	read_block_type_dir(dir_handle.block_num);
-	uint16_t next     = block.directory.next_dir_block;
-	uint16_t previous = block.directory.previous_dir_block;
+	BLOCK    next     = block.directory.next_dir_block;
+	BLOCK    previous = block.directory.previous_dir_block;
 
     if(previous) {
 		read_block_type_dir(previous);
@@ -344,7 +1315,13 @@ FS_STATUS I2CFS::delete_directory(DIR_HANDLE&  dir_handle) {
 	}
 
 	release_one_used_block(dir_handle.block_num);
+
+	#if I2CFS_NAME_TABLE
+	name_table_remove(dir_handle.block_num);
+	#endif
+
 	dir_handle.block_num = 0;
+	sync_if_due();
 
 	return FS_STATUS_OK;
 
@@ -366,18 +1343,30 @@ FS_STATUS I2CFS::erase(DIR_HANDLE& dir_handle, const char* name) {
 
     if(find_status != FS_STATUS_OK) return FS_STATUS_NOT_FOUND;
 
+    erase_file_entry(file_entry);
+    sync_if_due();
+
+    return FS_STATUS_OK;
+
+    #endif
+
+}
+
+void I2CFS::erase_file_entry(FILE_ENTRY& file_entry) {
+
+    #ifndef READ_ONLY
+
     truncate_file_entry(file_entry);
 
-    uint16_t next     = file_entry.next_file_block;
-    uint16_t previous = file_entry.previous_file_block;
+    BLOCK    next     = file_entry.next_file_block;
+    BLOCK    previous = file_entry.previous_file_block;
 
     if(previous) {
         read_block_type_file(previous);
         block.file.next_file_block = next;
         write_block_type_file(previous);
     } else {
-        master_block.first_file_block = next;
-        save_master_block();
+        set_bucket_head(file_entry.parent_directory, name_bucket(file_entry.name), next);
     }
 
     if(next) {
@@ -388,10 +1377,11 @@ FS_STATUS I2CFS::erase(DIR_HANDLE& dir_handle, const char* name) {
 
     release_one_used_block(file_entry.this_block);
 
-    return FS_STATUS_OK;
-
+    #if I2CFS_NAME_TABLE
+    name_table_remove(file_entry.this_block);
     #endif
 
+    #endif
 }
 
 FS_STATUS I2CFS::find_first_dir() {
@@ -411,18 +1401,65 @@ FS_STATUS I2CFS::find_next_dir(DIR_ENTRY& dir_entry) {
 
 FS_STATUS I2CFS::find_first_file(DIR_HANDLE&  dir_handle) {
 
-    dir_handle.next_file_block = master_block.first_file_block;
-	return FS_STATUS_OK;
-}
+    dir_handle.bucket          = 0;
+    dir_handle.next_file_block = bucket_head(dir_handle.block_num, 0);
+	return FS_STATUS_OK;
+}
+
+FS_STATUS I2CFS::find_next_file(DIR_HANDLE&  dir_handle, FILE_ENTRY& file_entry) {
+
+	while (!dir_handle.next_file_block) {
+		if(dir_handle.bucket + 1 >= I2CFS_DIR_BUCKETS) return FS_STATUS_NOT_FOUND;
+		dir_handle.next_file_block = bucket_head(dir_handle.block_num, ++dir_handle.bucket);
+	}
+
+	read_block_type_file(dir_handle.next_file_block);
+	dir_handle.next_file_block = block.file.next_file_block;
+	memcpy(&file_entry, &block, sizeof(FILE_ENTRY));
+
+	return FS_STATUS_OK;
+}
+
+FS_STATUS I2CFS::find_file(DIR_HANDLE& dir_handle, const char* name, FILE_ENTRY& file_entry) {
+
+	// Only the chain the name hashes to can hold it
+
+	dir_handle.bucket          = name_bucket(name);
+
+	#if I2CFS_NAME_TABLE
+
+	uint16_t hash = name_hash(name);
+
+	for(uint16_t i = 0; i < name_count; i++) {
+
+		NameEntry& entry = names[i];
+
+		if(entry.hash != hash || entry.parent != dir_handle.block_num || entry.parent == entry.block_num) continue;
+
+		read_block_type_file(entry.block_num);
+
+		if(strcmp(block.file.name, name) == 0) {
+			dir_handle.next_file_block = block.file.next_file_block;
+			memcpy(&file_entry, &block, sizeof(FILE_ENTRY));
+			return FS_STATUS_OK;
+		}
+	}
+
+	if(names_complete) {
+		dir_handle.next_file_block = 0;
+		return FS_STATUS_NOT_FOUND;
+	}
+
+	#endif
 
-FS_STATUS I2CFS::find_next_file(DIR_HANDLE&  dir_handle, FILE_ENTRY& file_entry) {
+	dir_handle.next_file_block = bucket_head(dir_handle.block_num, dir_handle.bucket);
 
 	while (dir_handle.next_file_block) {
 
 		read_block_type_file(dir_handle.next_file_block);
 		dir_handle.next_file_block = block.file.next_file_block;
 
-		if (block.file.parent_directory == dir_handle.block_num) {
+		if(strcmp(block.file.name, name) == 0) {
 			memcpy(&file_entry, &block, sizeof(FILE_ENTRY));
 			return FS_STATUS_OK;
 		}
@@ -431,25 +1468,15 @@ FS_STATUS I2CFS::find_next_file(DIR_HANDLE&  dir_handle, FILE_ENTRY& file_entry)
 	return FS_STATUS_NOT_FOUND;
 }
 
-FS_STATUS I2CFS::find_file(DIR_HANDLE& dir_handle, const char* name, FILE_ENTRY& file_entry) {
-
-	find_first_file(dir_handle);
-
-	while(find_next_file(dir_handle, file_entry) == FS_STATUS_OK) {
-		if(strcmp(file_entry.name, name) == 0) return FS_STATUS_OK;
-	}
-
-	return FS_STATUS_NOT_FOUND;
-}
-
 FS_STATUS I2CFS::create_file_entry(DIR_HANDLE& dir_handle, const char* name, FILE_ENTRY& file_entry) {
 
-	if(!strlen(name)) return FS_STATUS_INVALID_FILE_NAME;
+	if(!strlen(name) || strlen(name) >= sizeof(FILENAME)) return FS_STATUS_INVALID_FILE_NAME;
 
     BLOCK new_block_num = get_one_free_block();
     if(!new_block_num) return FS_STATUS_DISK_FULL;
 
-    BLOCK previous_file_block_num = master_block.first_file_block;
+    uint8_t bucket                  = name_bucket(name);
+    BLOCK   previous_file_block_num = bucket_head(dir_handle.block_num, bucket);
 
     if(previous_file_block_num) {
 
@@ -464,9 +1491,7 @@ FS_STATUS I2CFS::create_file_entry(DIR_HANDLE& dir_handle, const char* name, FIL
 
     // Set new first Block of chain
 
-    master_block.first_file_block = new_block_num;
-
-    save_master_block();
+    set_bucket_head(dir_handle.block_num, bucket, new_block_num);
 
     // Save new Block of chain
 
@@ -483,6 +1508,11 @@ FS_STATUS I2CFS::create_file_entry(DIR_HANDLE& dir_handle, const char* name, FIL
     memcpy(block.file.name, name, strlen(name) + 1);
 
     write_block_type_file(new_block_num);
+
+    #if I2CFS_NAME_TABLE
+    name_table_add(name, dir_handle.block_num, new_block_num);
+    #endif
+
     read_block_type_file(new_block_num);
     memcpy(&file_entry, &block.file, sizeof(FILE_ENTRY));
 
@@ -492,12 +1522,14 @@ FS_STATUS I2CFS::create_file_entry(DIR_HANDLE& dir_handle, const char* name, FIL
 
 FS_STATUS I2CFS::truncate_file_entry(FILE_ENTRY& file_entry) {
 
-	release_data_blocks(file_entry.first_data_block);
+	release_data_blocks(file_entry);
 
+    memcpy(&block.file, &file_entry, sizeof(FILE_ENTRY));
     block.file.size                = 0;
     block.file.num_data_blocks     = 0;
     block.file.first_data_block    = 0;
     block.file.last_data_block     = 0;
+    block.file.attributes         &= ~FS_ATTR_INLINE;
 
 	write_block_type_file(file_entry.this_block);
 
@@ -507,6 +1539,54 @@ FS_STATUS I2CFS::truncate_file_entry(FILE_ENTRY& file_entry) {
 
 }
 
+BLOCK I2CFS::find_data_block(FILE_HANDLE& file_handle, BLOCK index) {
+
+    // The last block is known, otherwise the walk starts from the nearest
+    // block already known before index: the first one, a seek point or
+    // the block the handle is at. Only the links are read
+
+    BLOCK last_index = file_handle.size ? (file_handle.size - 1) / DATA_SIZE : 0;
+
+    if(index == last_index && file_handle.last_data_block) return file_handle.last_data_block;
+
+    BLOCK    at        = 0;
+    BLOCK    block_num = file_handle.first_data_block;
+
+    #if I2CFS_SEEK_POINTS
+    for(uint8_t i = 0; i < I2CFS_SEEK_POINTS; i++) {
+        BLOCK point = (i + 1) * file_handle.seek_stride;
+        if(point > index) break;
+        if(file_handle.seek_points[i]) {
+            at        = point;
+            block_num = file_handle.seek_points[i];
+        }
+    }
+    #endif
+
+    if(file_handle.next_data_block) {
+        BLOCK current = (file_handle.position - file_handle.position_in_block) / DATA_SIZE;
+        if(current <= index && current > at) {
+            at        = current;
+            block_num = file_handle.next_data_block;
+        }
+    }
+
+    while(at < index && block_num) {
+
+        block_num = get_link(block_num);
+        at++;
+
+        #if I2CFS_SEEK_POINTS
+        if(file_handle.seek_stride && !(at % file_handle.seek_stride)) {
+            BLOCK i = at / file_handle.seek_stride - 1;
+            if(i < I2CFS_SEEK_POINTS) file_handle.seek_points[i] = block_num;
+        }
+        #endif
+    }
+
+    return block_num;
+}
+
 FS_STATUS I2CFS::seek(FILE_HANDLE& file_handle, uint32_t pos) {
 
     if(!file_handle.block_num) return FS_STATUS_INVALID_HANDLE;
@@ -516,41 +1596,35 @@ FS_STATUS I2CFS::seek(FILE_HANDLE& file_handle, uint32_t pos) {
     	IF_SERIAL_DEBUG(pdebug_P(PSTR("seek: invalid\n")))
     }
 
+    #ifndef READ_ONLY
+    FS_STATUS status = flush_write_buffer(file_handle);
+    if(status != FS_STATUS_OK) return status;
+    #endif
+
     IF_SERIAL_DEBUG(pdebug_P(PSTR("seek: begin\n")))
     IF_SERIAL_DEBUG(file_handle.print())
 
-    file_handle.position           = 0;
-    file_handle.position_in_block  = 0;
-
-    BLOCK next_data_block  = file_handle.first_data_block;
-
-	while (true) {
-
-		if(next_data_block) { 
-			read_block_type_data(next_data_block);
-		}
-
-     	file_handle.next_data_block = next_data_block;
-
-		if(pos >= DATA_SIZE) {
-
-			file_handle.position += DATA_SIZE;
-			pos -= DATA_SIZE;
-			next_data_block = block.data.next_data_block;
+    if(file_handle.inline_at) {
+        file_handle.position = pos;
+        return FS_STATUS_OK;
+    }
 
-			if(!next_data_block && pos) return FS_STATUS_ACESS_DENIED;
+    // The end of a file that fills its last block has no block yet, the
+    // next write appends one
 
-		} else {
+    BLOCK next_data_block = 0;
 
-			file_handle.position += pos;
-			file_handle.position_in_block = (uint8_t) pos;
-			IF_SERIAL_DEBUG(file_handle.print())
-		    IF_SERIAL_DEBUG(pdebug_P(PSTR("seek: end\n")))
-			return FS_STATUS_OK;
+    if(pos < file_handle.size || pos % DATA_SIZE) {
+        next_data_block = find_data_block(file_handle, pos / DATA_SIZE);
+        if(!next_data_block) return FS_STATUS_ACESS_DENIED;
+    }
 
-		}
-	}
+    file_handle.next_data_block   = next_data_block;
+    file_handle.position          = pos;
+    file_handle.position_in_block = pos % DATA_SIZE;
 
+    I2CFS_TRACE_EVENT(TRACE_SEEK, next_data_block, file_handle.position_in_block, 0)
+    IF_SERIAL_DEBUG(file_handle.print())
     IF_SERIAL_DEBUG(pdebug_P(PSTR("seek: end\n")))
 	return FS_STATUS_OK;
 
@@ -564,6 +1638,28 @@ void  I2CFS::file_handle_from_file_entry(FILE_HANDLE& file_handle,
     file_handle.block_num         = file_entry.this_block;
     file_handle.size              = file_entry.size;
     file_handle.first_data_block  = file_entry.first_data_block;
+    file_handle.last_data_block   = file_entry.last_data_block;
+    file_handle.next_data_block   = 0;
+    file_handle.link_of           = 0;
+    file_handle.write_buffered    = 0;
+    file_handle.inline_at         = 0;
+
+    // The data of an inline file follows the name, an empty file with no
+    // data block may start there too
+
+    if((file_entry.attributes & FS_ATTR_INLINE) || (I2CFS_INLINE_FILES && !file_entry.first_data_block)) {
+        file_handle.inline_at = offsetof(FileBlock, name) + strlen(file_entry.name) + 1;
+    }
+
+    #if I2CFS_SEEK_POINTS
+
+    // Points spread evenly over the blocks the file has when opened
+
+    file_handle.seek_stride = (file_entry.size + DATA_SIZE - 1) / DATA_SIZE / (I2CFS_SEEK_POINTS + 1) + 1;
+    memset(file_handle.seek_points, 0, sizeof(file_handle.seek_points));
+
+    #endif
+
     seek(file_handle, seek_pos);
 
 }
@@ -572,6 +1668,8 @@ FS_STATUS I2CFS::open(const char* name, FILE_MODE mode, DIR_HANDLE& dir_handle,
 
     IF_SERIAL_DEBUG(pdebug_P(PSTR("open: begin\n")))
 
+    file_handle.write_buffer = 0;
+
     FILE_ENTRY file_entry;
     FS_STATUS  find_status = find_file(dir_handle, name, file_entry);
 
@@ -625,6 +1723,11 @@ FS_STATUS I2CFS::open(const char* name, FILE_MODE mode, DIR_HANDLE& dir_handle,
 	if(mode == MODE_APPEND) seek(file_handle, file_entry.size);
 	else                    seek(file_handle, 0);
     */
+    #ifndef READ_ONLY
+    if(mode != MODE_READ) sync_if_due();
+    #endif
+
+    I2CFS_TRACE_EVENT(TRACE_OPEN, file_handle.block_num, mode, 0)
     IF_SERIAL_DEBUG(file_handle.print())
     IF_SERIAL_DEBUG(pdebug_P(PSTR("open: end\n")))
 
@@ -633,59 +1736,172 @@ FS_STATUS I2CFS::open(const char* name, FILE_MODE mode, DIR_HANDLE& dir_handle,
 }
 
 FS_STATUS I2CFS::close(FILE_HANDLE& file_handle) {
+
+   FS_STATUS status = FS_STATUS_OK;
+
+   I2CFS_TRACE_EVENT(TRACE_CLOSE, file_handle.block_num, 0, 0)
+
+   #ifndef READ_ONLY
+   if(file_handle.block_num) status = flush_write_buffer(file_handle);
+   #endif
+
    file_handle.block_num = 0;
-   return FS_STATUS_OK;
+   if(sync() != FS_STATUS_OK) return FS_STATUS_DISK_FULL;
+   return status;
 }
 
-BLOCK I2CFS::append_new_data_block(BLOCK file_block, BLOCK last_data_block) {
+void I2CFS::write_stripe(BLOCK* blocks, uint8_t count, BLOCK next_block, uint8_t* data) {
 
-    BLOCK new_block_num = get_one_free_block();
+    // Full data blocks on different chips go out one page write at a
+    // time, round the chips: each chip runs its write cycle while the bus
+    // serves the others. Blocks start at a multiple of the page size, or
+    // the page size is a multiple of BLOCK_SIZE, so the span of a page
+    // write only depends on the offset in the block
+
+    BLOCK_OFFSET from = 0;
 
-    if(!new_block_num) return 0;
-    read_block_type_file(file_block);
+    while(from < BLOCK_SIZE) {
 
-    if(!last_data_block) {
-    	block.file.first_data_block = new_block_num;
+        uint16_t bytes_write = min(driver_write_span(chip_addr[blocks[0] % device_chips], from), BLOCK_SIZE - from);
+
+        for(uint8_t i = 0; i < count; i++) {
+            BLOCK next = i + 1 < count ? blocks[i + 1] : next_block;
+            #if I2CFS_FAT_TABLE
+            if(!from) set_link(blocks[i], next);
+            #else
+            block.data.next_data_block = next;
+            #endif
+            memcpy(block.data.data, data + i * DATA_SIZE, DATA_SIZE);
+            write_block_ex(blocks[i], from, block.raw + from, bytes_write);
+        }
+
+        from += bytes_write;
     }
+}
+
+FS_STATUS I2CFS::append_data_blocks(FILE_HANDLE& file_handle, 
+                                    uint8_t*& pointer, 
+                                    uint32_t& size, 
+                                    uint32_t* really_write) {
+
+    // Each new block is written once, link and payload in one page write,
+    // with the number of the next one allocated ahead. The old last block
+    // gets its link and the file block is updated once, at the end, on
+    // every way out: a full disk keeps the bytes written before it
+
+    read_block_type_file(file_handle.block_num);
 
-    block.file.last_data_block = new_block_num;
-    write_block_type_file(file_block);
+    BLOCK     last_data_block = block.file.last_data_block;
+    BLOCK     run             = 0;
+    uint8_t   run_left        = 0;
+    BLOCK     this_block      = get_data_block(run, run_left, size);
+    FS_STATUS status          = FS_STATUS_OK;
+    BLOCK     new_blocks      = 0;
+    BLOCK     stripe[8];
+    uint8_t   striped         = 0;
+    uint8_t*  stripe_data     = pointer;
 
-    if(last_data_block) {
-      read_block_type_data(last_data_block);
-      block.data.next_data_block = new_block_num;
-      write_block_type_data(last_data_block);
+    if(!this_block)          status = FS_STATUS_DISK_FULL;
+    else if(last_data_block) set_link(last_data_block, this_block);
+    else                     file_handle.first_data_block = this_block;
+
+    file_handle.link_of = 0;
+
+    while(this_block) {
+
+        uint16_t bytes_write = min(size, DATA_SIZE);
+        BLOCK   next_block  = 0;
+
+        if(size > bytes_write) {
+            next_block = get_data_block(run, run_left, size - bytes_write);
+            if(!next_block) status = FS_STATUS_DISK_FULL;
+        }
+
+        // The last block goes to the cache, where the next appends to it,
+        // or the link to the block after it, are merged. On several chips
+        // full blocks are lined up, one per chip, and written together
+
+        if(next_block && device_chips > 1) {
+            if(!striped) stripe_data = pointer;
+            stripe[striped++] = this_block;
+            if(striped == device_chips) {
+                write_stripe(stripe, striped, next_block, stripe_data);
+                striped = 0;
+            }
+        } else {
+            if(striped) write_stripe(stripe, striped, this_block, stripe_data);
+            striped = 0;
+
+            #if I2CFS_FAT_TABLE
+            set_link(this_block, next_block);
+            #else
+            block.data.next_data_block = next_block;
+            #endif
+            memcpy(block.data.data, pointer, bytes_write);
+
+            if(next_block) write_block_ex(this_block, 0, block.raw, BLOCK_SIZE);
+            else           write_block(this_block, DATA_OFFSET + bytes_write);
+        }
+
+        pointer              += bytes_write;
+        size                 -= bytes_write;
+        file_handle.position += bytes_write;
+        *really_write        += bytes_write;
+
+        // A full last block leaves the handle waiting for a new one
+
+        file_handle.next_data_block   = bytes_write == DATA_SIZE ? 0 : this_block;
+        file_handle.position_in_block = bytes_write == DATA_SIZE ? 0 : bytes_write;
+
+        last_data_block             = this_block;
+        file_handle.last_data_block = this_block;
+        this_block                  = next_block;
+        new_blocks++;
     }
 
-    read_block_type_data(new_block_num);
-    block.data.next_data_block = 0;
-    write_block_type_data(new_block_num);
+    if(!new_blocks && file_handle.position <= file_handle.size) return status;
+
+    read_block_type_file(file_handle.block_num);
+
+    // A count of ZERO on a file with blocks was never kept, it stays so
+
+    if(block.file.num_data_blocks || !block.file.first_data_block) {
+        block.file.num_data_blocks += new_blocks;
+    }
 
-    return new_block_num;
+    if(!block.file.first_data_block) block.file.first_data_block = file_handle.first_data_block;
+    block.file.last_data_block = last_data_block;
 
+    if(file_handle.position > file_handle.size) {
+        block.file.size  = file_handle.position;
+        file_handle.size = file_handle.position;
+    }
 
-}	
+    write_block_type_file(file_handle.block_num);
+
+    return status;
+}
 
 
 FS_STATUS I2CFS::read(FILE_HANDLE& file_handle, 
                       void*        buffer, 
-                      uint16_t     size, 
-                      uint16_t*    really_read) {
+                      uint32_t     size, 
+                      uint32_t*    really_read) {
     return read(file_handle, buffer, size, really_read, false, 0);
 }
 
 FS_STATUS I2CFS::read(FILE_HANDLE& file_handle, 
                       void*        buffer, 
-                      uint16_t     size, 
-                      uint16_t*    really_read,
+                      uint32_t     size, 
+                      uint32_t*    really_read,
                       char         delimiter) {
     return read(file_handle, buffer, size, really_read, true, delimiter);
 }
 
 FS_STATUS I2CFS::read(FILE_HANDLE& file_handle, 
                       void*        buffer, 
-                      uint16_t     size, 
-                      uint16_t*    really_read,
+                      uint32_t     size, 
+                      uint32_t*    really_read,
                       bool         has_delimiter,
                       char         delimiter) {
 
@@ -696,7 +1912,39 @@ FS_STATUS I2CFS::read(FILE_HANDLE& file_handle,
 
     if(!file_handle.block_num) return FS_STATUS_INVALID_HANDLE;
 
-    IF_SERIAL_DEBUG(pdebug_P(PSTR("read: begin (%i)\n"), size))
+    #ifndef READ_ONLY
+    FS_STATUS status = flush_write_buffer(file_handle);
+    if(status != FS_STATUS_OK) return status;
+    #endif
+
+    IF_SERIAL_DEBUG(pdebug_P(PSTR("read: begin (%lu)\n"), (unsigned long) size))
+
+    // An inline file is read from its file block, which open() left in
+    // the cache
+
+    if(file_handle.inline_at) {
+
+        uint32_t bytes_read = min(size, file_handle.size - file_handle.position);
+
+        read_block_ex(file_handle.block_num,
+                      file_handle.inline_at + file_handle.position,
+                      pointer,
+                      bytes_read);
+
+        if(has_delimiter) {
+            for(uint32_t j = 0; j < bytes_read; j++) {
+                if(pointer[j] == (uint8_t) delimiter) {
+                    bytes_read = j + 1;
+                    size       = bytes_read;
+                }
+            }
+        }
+
+        file_handle.position += bytes_read;
+        *really_read          = bytes_read;
+
+        return bytes_read < size ? FS_STATUS_END_OF_FILE : FS_STATUS_OK;
+    }
 
     while(size) {
 
@@ -708,7 +1956,7 @@ FS_STATUS I2CFS::read(FILE_HANDLE& file_handle,
     	}
 
 
-    	uint8_t bytes_read = min(size, 
+    	uint16_t bytes_read = min(size, 
     		                     (DATA_SIZE - file_handle.position_in_block));
 
     	if ((file_handle.position + bytes_read ) > file_handle.size) {
@@ -716,30 +1964,36 @@ FS_STATUS I2CFS::read(FILE_HANDLE& file_handle,
     		eof = true;
     	}
 
-        read_block_ex(file_handle.next_data_block, 
-        	          file_handle.position_in_block + sizeof(BLOCK), 
-        	          &block.raw, 
+        // Entering a block, its link is read just before the payload: the
+        // driver goes on from the current address, so following it later
+        // costs no address phase and no second read
+
+        BLOCK data_block = file_handle.next_data_block;
+
+        if(!file_handle.position_in_block && file_handle.link_of != data_block) {
+            file_handle.link    = get_link(data_block);
+            file_handle.link_of = data_block;
+        }
+
+        read_block_ex(data_block, 
+        	          file_handle.position_in_block + DATA_OFFSET, 
+        	          pointer, 
         	          bytes_read);
 
         if(has_delimiter) {
 
-            uint8_t j=0;
+            uint16_t j=0;
             while(j < bytes_read) {
 
-                char c = block.raw[j++];
-                *pointer++ = c;
-                if(c == delimiter) {
+                if(pointer[j++] == (uint8_t) delimiter) {
                     bytes_read = j;
                     size = 0;
                 }
             }
-
-        } else {
-
-            memcpy(pointer, &block.raw, bytes_read);
-            pointer += bytes_read;
         }
 
+        pointer += bytes_read;
+
         #ifdef SERIAL_DEBUG
         pdebug_P(PSTR("read: next_data: %u, offset: %u, bytes_read: %i\n"),
         	     file_handle.next_data_block, file_handle.position_in_block, bytes_read);
@@ -754,8 +2008,12 @@ FS_STATUS I2CFS::read(FILE_HANDLE& file_handle,
 
         if((file_handle.position_in_block == DATA_SIZE)) {
 
-        	read_block_type_data(file_handle.next_data_block);
-	 	    file_handle.next_data_block   = block.data.next_data_block;
+            if(file_handle.link_of != data_block) {
+                file_handle.link = get_link(data_block);
+            }
+
+	 	    file_handle.next_data_block   = file_handle.link;
+	 	    file_handle.link_of           = 0;
 	 	    file_handle.position_in_block = 0;
 	 	}
 
@@ -767,7 +2025,7 @@ FS_STATUS I2CFS::read(FILE_HANDLE& file_handle,
 
 }
 
-FS_STATUS I2CFS::write(FILE_HANDLE& file_handle, void* buffer, uint16_t size, uint16_t* really_write) {
+FS_STATUS I2CFS::write(FILE_HANDLE& file_handle, void* buffer, uint32_t size, uint32_t* really_write) {
 
     #ifdef READ_ONLY
 
@@ -781,7 +2039,150 @@ FS_STATUS I2CFS::write(FILE_HANDLE& file_handle, void* buffer, uint16_t size, ui
     if(!file_handle.block_num)        return FS_STATUS_INVALID_HANDLE;   
     if(file_handle.mode == MODE_READ) return FS_STATUS_ACESS_DENIED;
 
-    IF_SERIAL_DEBUG(pdebug_P(PSTR("write: (%i) begin\n"), size))
+    if(file_handle.write_buffer) {
+
+        if(file_handle.position != file_handle.size) {
+            FS_STATUS status = flush_write_buffer(file_handle);
+            if(status != FS_STATUS_OK) return status;
+        } else {
+
+            // Appends stay in RAM until the buffer is full up to a data
+            // block boundary, they are then written as whole blocks
+
+            while(size) {
+
+                uint32_t committed = file_handle.position - file_handle.write_buffered;
+                uint16_t room      = DATA_SIZE - committed % DATA_SIZE;
+
+                while(room + DATA_SIZE <= file_handle.write_buffer_size) room += DATA_SIZE;
+                if(room > file_handle.write_buffer_size) room = file_handle.write_buffer_size;
+
+                // A buffer a full disk did not take stays full, it is
+                // flushed again before anything is added
+
+                uint16_t bytes_write = 0;
+                if(room > file_handle.write_buffered) {
+                    bytes_write = min(size, (uint32_t)(room - file_handle.write_buffered));
+                }
+
+                memcpy(file_handle.write_buffer + file_handle.write_buffered, pointer, bytes_write);
+                file_handle.write_buffered += bytes_write;
+                file_handle.position       += bytes_write;
+                file_handle.size           += bytes_write;
+                pointer                    += bytes_write;
+                size                       -= bytes_write;
+                *really_write              += bytes_write;
+
+                if(file_handle.write_buffered >= room) {
+                    FS_STATUS status = flush_write_buffer(file_handle);
+                    if(status != FS_STATUS_OK) return status;
+                }
+            }
+
+            return FS_STATUS_OK;
+        }
+    }
+
+    return write_data(file_handle, pointer, size, really_write);
+
+    #endif
+
+}
+
+#ifndef READ_ONLY
+
+FS_STATUS I2CFS::flush_write_buffer(FILE_HANDLE& file_handle) {
+
+    uint16_t buffered = file_handle.write_buffered;
+    uint32_t written  = 0;
+
+    if(!buffered) return FS_STATUS_OK;
+
+    // The buffered bytes end the file, the handle goes back to where the
+    // chip has it and write_data() moves it forward again
+
+    file_handle.write_buffered = 0;
+    file_handle.position      -= buffered;
+    file_handle.size          -= buffered;
+
+    FS_STATUS status = write_data(file_handle, file_handle.write_buffer, buffered, &written);
+
+    // What a full disk did not take stays buffered, ahead of the handle,
+    // for the next flush to try again
+
+    if(written < buffered) {
+        buffered -= written;
+        memmove(file_handle.write_buffer, file_handle.write_buffer + written, buffered);
+        file_handle.write_buffered = buffered;
+        file_handle.position      += buffered;
+        file_handle.size          += buffered;
+    }
+
+    return status;
+}
+
+#endif
+
+FS_STATUS I2CFS::flush(FILE_HANDLE& file_handle) {
+
+    #ifndef READ_ONLY
+    FS_STATUS status = flush_write_buffer(file_handle);
+    if(status != FS_STATUS_OK) return status;
+    #endif
+
+    return flush();
+}
+
+FS_STATUS I2CFS::set_write_buffer(FILE_HANDLE& file_handle, void* buffer, uint16_t size) {
+
+    #ifdef READ_ONLY
+
+    return FS_STATUS_ACESS_DENIED;
+
+    #else
+
+    // Bytes a full disk left in the old buffer keep it attached
+
+    FS_STATUS status = flush_write_buffer(file_handle);
+    if(status != FS_STATUS_OK) return status;
+
+    file_handle.write_buffer      = size ? (uint8_t*) buffer : 0;
+    file_handle.write_buffer_size = size;
+
+    return FS_STATUS_OK;
+
+    #endif
+}
+
+FS_STATUS I2CFS::write_data(FILE_HANDLE& file_handle, uint8_t* pointer, uint32_t size, uint32_t* really_write) {
+
+    #ifdef READ_ONLY
+
+    return FS_STATUS_ACESS_DENIED;
+
+    #else
+
+    IF_SERIAL_DEBUG(pdebug_P(PSTR("write: (%lu) begin\n"), (unsigned long) size))
+
+    // A file that still fits after its name stays in its file block, one
+    // that outgrows it moves to a data block first
+
+    if(file_handle.inline_at && size) {
+
+        if(file_handle.position + size <= (uint32_t)(BLOCK_SIZE - file_handle.inline_at)) {
+            write_inline(file_handle, pointer, size);
+            *really_write += size;
+            sync_if_due();
+            return FS_STATUS_OK;
+        }
+
+        if(spill_inline(file_handle) != FS_STATUS_OK) {
+            sync_if_due();
+            return FS_STATUS_DISK_FULL;
+        }
+    }
+
+    FS_STATUS status = FS_STATUS_OK;
 
     while(size) {
 
@@ -790,26 +2191,19 @@ FS_STATUS I2CFS::write(FILE_HANDLE& file_handle, void* buffer, uint16_t size, ui
 
     	if(!file_handle.next_data_block) {
 
-    		read_block_type_file(file_handle.block_num);
-    		file_handle.next_data_block = append_new_data_block(file_handle.block_num, block.file.last_data_block);
-            if(!file_handle.first_data_block) {
-                file_handle.first_data_block = file_handle.next_data_block;
-            }
-
-    		if(!file_handle.next_data_block) {
-                IF_SERIAL_DEBUG(pdebug_P(PSTR("write: end disk full\n")))
-    			return FS_STATUS_DISK_FULL;
-    		}
+            // Past the last block: the rest goes to new blocks. The size,
+            // also of what went to the old last block, is stored there
 
-    		file_handle.position_in_block = 0;
+    		status = append_data_blocks(file_handle, pointer, size, really_write);
+            break;
         };
 
         uint16_t pib        = file_handle.position_in_block;
-    	uint8_t bytes_write = min(size, 
+    	uint16_t bytes_write = min(size, 
     		                     (DATA_SIZE - pib));
 
         write_block_ex(file_handle.next_data_block, 
-        	           pib + sizeof(BLOCK), 
+        	           pib + DATA_OFFSET, 
         	           pointer, 
         	           bytes_write);
 
@@ -825,9 +2219,7 @@ FS_STATUS I2CFS::write(FILE_HANDLE& file_handle, void* buffer, uint16_t size, ui
         *really_write                 += bytes_write;
 
         if(file_handle.position_in_block == DATA_SIZE) {
-          //file_handle.next_data_block    = next;
-          read_block_type_data(file_handle.next_data_block);
-          file_handle.next_data_block   = block.data.next_data_block;
+          file_handle.next_data_block   = get_link(file_handle.next_data_block);
           file_handle.position_in_block = 0;
         }
 
@@ -840,16 +2232,86 @@ FS_STATUS I2CFS::write(FILE_HANDLE& file_handle, void* buffer, uint16_t size, ui
    		write_block_type_file(file_handle.block_num);
    	}
 
+    sync_if_due();
 
     IF_SERIAL_DEBUG(file_handle.print())
-    IF_SERIAL_DEBUG(pdebug_P(PSTR("write: end\n")))
+    IF_SERIAL_DEBUG(pdebug_P(status == FS_STATUS_OK ? PSTR("write: end\n") : PSTR("write: end disk full\n")))
 
-    return FS_STATUS_OK;
+    return status;
+
+    #endif
+
+}
+
+#ifndef READ_ONLY
+
+void I2CFS::write_inline(FILE_HANDLE& file_handle, uint8_t* pointer, uint32_t size) {
 
+    // Data, size and flag go out together, in one write of the file block
+
+    uint32_t end   = file_handle.position + size;
+    uint16_t bytes = file_handle.inline_at;
+
+    if(end < file_handle.size) end = file_handle.size;
+    bytes += end;
+    if(bytes < sizeof(FileBlock)) bytes = sizeof(FileBlock);
+
+    read_block(file_handle.block_num, bytes);
+    memcpy(block.raw + file_handle.inline_at + file_handle.position, pointer, size);
+    block.file.size        = end;
+    block.file.attributes |= FS_ATTR_INLINE;
+    write_block(file_handle.block_num, bytes);
+    IF_SERIAL_DEBUG(block.file.print('W'));
+
+    file_handle.position += size;
+    file_handle.size      = end;
+}
+
+FS_STATUS I2CFS::spill_inline(FILE_HANDLE& file_handle) {
+
+    // An inline file is shorter than DATA_SIZE, its data moves whole to a
+    // first data block and the file goes on as any other. An empty one
+    // just stops being inline
+
+    BLOCK_OFFSET at    = file_handle.inline_at;
+    uint16_t     size  = file_handle.size;
+    uint16_t     bytes = at + size;
+
+    if(!size) {
+        file_handle.inline_at = 0;
+        return FS_STATUS_OK;
+    }
+
+    BLOCK data_block = get_one_free_block();
+    if(!data_block) return FS_STATUS_DISK_FULL;
+
+    if(bytes < sizeof(FileBlock)) bytes = sizeof(FileBlock);
+
+    read_block(file_handle.block_num, bytes);
+    block.file.attributes      &= ~FS_ATTR_INLINE;
+    block.file.first_data_block = data_block;
+    block.file.last_data_block  = data_block;
+    block.file.num_data_blocks  = 1;
+    write_block_type_file(file_handle.block_num);
+
+    memmove(block.data.data, block.raw + at, size);
+    #if !I2CFS_FAT_TABLE
+    block.data.next_data_block = 0;
     #endif
+    write_block(data_block, DATA_OFFSET + size);
+
+    file_handle.inline_at         = 0;
+    file_handle.first_data_block  = data_block;
+    file_handle.last_data_block   = data_block;
+    file_handle.next_data_block   = data_block;
+    file_handle.position_in_block = file_handle.position;
+    file_handle.link_of           = 0;
 
+    return FS_STATUS_OK;
 }
 
+#endif
+
 FS_STATUS I2CFS::truncate(FILE_HANDLE& file_handle) {
 
     #ifdef READ_ONLY
@@ -866,6 +2328,7 @@ FS_STATUS I2CFS::truncate(FILE_HANDLE& file_handle) {
     memcpy(&file_entry, &block.file, sizeof(FILE_ENTRY));
     truncate_file_entry(file_entry);
     file_handle_from_file_entry(file_handle, file_entry, 0);
+    sync_if_due();
 
     return FS_STATUS_OK;
 
@@ -880,23 +2343,83 @@ FS_STATUS I2CFS::format(uint16_t size_in_KB) { // 204 bytes
 
     #else
 
-    uint16_t total_blocks = size_in_KB << 4; // size_in_KB * 1024 / 64
+    // Blocks past the last number a BLOCK can hold are left out
+
+    uint32_t total_blocks = (uint32_t) size_in_KB * (1024 / BLOCK_SIZE);
+    if(total_blocks > (BLOCK) ~0) total_blocks = (BLOCK) ~0;
+
+    // Nor can a volume be larger than the chips begin() could address
+
+    if(total_blocks > device_blocks) return FS_STATUS_DISK_FULL;
+
+    #if I2CFS_FREE_BITMAP
+    if(((total_blocks + 7) >> 3) > I2CFS_FREE_BITMAP) return FS_STATUS_DISK_FULL;
+    #endif
+
+    #if I2CFS_FAT_TABLE
+    if(total_blocks * sizeof(BLOCK) > I2CFS_FAT_TABLE) return FS_STATUS_DISK_FULL;
+    #endif
+
+    #if I2CFS_CACHE_BLOCKS
+    cache_invalidate();
+    #endif
 
 	master_block.total_blocks     		= total_blocks; 
 	master_block.used_blocks      		= 1;
-	master_block.first_free_block 		= 1;
-	master_block.first_file_block 		= 0;
+	master_block.first_free_block 		= 0;
+	master_block.next_fresh_block 		= total_blocks > 1 ? 1 : 0;
+	memset(master_block.root_files, 0, sizeof(master_block.root_files));
+
+	#if I2CFS_NAME_TABLE
+	name_count     = 0;
+	names_complete = true;
+	#endif
 	master_block.first_directory_block  = 0;
+	master_block.flags                  = 0;
+	master_changes                      = 0;
 
-    save_master_block();
+    #if I2CFS_FREE_BITMAP
 
-    uint16_t last_block=total_blocks - 1; 
+    // The master block and the bitmap blocks are the only ones in use
 
-	for (uint16_t i=1; i<=last_block; i++)
-	{
-		 block.free.next_free_block = (i == last_block ? 0 : i + 1);
-		 write_block_type_free(i);
-	}
+    memset(bitmap, 0, sizeof(bitmap));
+    master_block.next_fresh_block = 0;
+    bitmap_cursor                 = 1;
+    bitmap_dirty_to               = 0;
+
+    for(BLOCK i = 0; i <= bitmap_blocks(); i++) bitmap_set(i, true);
+
+    master_block.used_blocks = 1 + bitmap_blocks();
+    bitmap_dirty_to          = (total_blocks + 7) >> 3;
+    save_bitmap();
+
+    #endif
+
+    #if I2CFS_FAT_TABLE
+
+    // The master block and the table blocks are the only ones in use
+
+    memset(fat, 0, sizeof(fat));
+    master_block.next_fresh_block = 0;
+    fat_cursor                    = 1;
+    fat_dirty_to                  = 0;
+
+    for(BLOCK i = 0; i <= fat_blocks(); i++) fat_set(i, FAT_END);
+
+    master_block.used_blocks = 1 + fat_blocks();
+    fat_dirty_from           = 0;
+    fat_dirty_to             = total_blocks * sizeof(BLOCK);
+    save_fat();
+
+    #endif
+
+    // Only the master block is written: data blocks are handed out from
+    // next_fresh_block and get their links when they are first released
+
+    I2CFS_TRACE_EVENT(TRACE_FORMAT, total_blocks, 0, 0)
+    save_master_block();
+
+	return flush();
 
 	#endif
 
@@ -905,7 +2428,7 @@ FS_STATUS I2CFS::format(uint16_t size_in_KB) { // 204 bytes
 #ifdef SERIAL_DEBUG
 
 const void MasterBlock::print(char op) const {
-	char buffer[90];
+	char buffer[110];
 	toString(buffer, sizeof(buffer));
 	pdebug_P(PSTR("MasterBlock(%c): %s\n"), op, buffer);
 }
@@ -913,10 +2436,10 @@ const void MasterBlock::print(char op) const {
 const void MasterBlock::toString(char* buffer, uint8_t size_buf) const {
 
 	snprintf_P(buffer, size_buf, 
-		       PSTR("total: %u, used: %u, first_free: %u, first_file: %u, first_dir: %u"), 
+		       PSTR("total: %u, used: %u, first_free: %u, first_dir: %u, flags: %u, fresh: %u"), 
 		       total_blocks, used_blocks, 
 		       first_free_block,
-		       first_file_block, first_directory_block);
+		       first_directory_block, flags, next_fresh_block);
 }
 
 const void DataBlock::print(char op, BLOCK this_block) const {
@@ -927,9 +2450,13 @@ const void DataBlock::print(char op, BLOCK this_block) const {
 
 const void DataBlock::toString(char* buffer, uint8_t size_buf) const {
 
+	#if I2CFS_FAT_TABLE
+	snprintf_P(buffer, size_buf, PSTR("data: %u bytes"), (unsigned) sizeof(data));
+	#else
 	snprintf_P(buffer, size_buf, 
 		       PSTR("next_data_block: %u"), 
 		       next_data_block);
+	#endif
 
 }
 
@@ -988,9 +2515,9 @@ const void FILE_HANDLE::toString(char* buffer, uint8_t size_buf) const {
 
     
 	snprintf_P(buffer, size_buf, 
-		       PSTR("file_block: %i, position: %lu, next_data: %u, pos_in_block: %u, size: %lu, first_data: %u"), 
+		       PSTR("file_block: %i, position: %lu, next_data: %u, pos_in_block: %u, size: %lu, first_data: %u, last_data: %u"), 
                block_num, position, next_data_block, position_in_block,
-               size, first_data_block);
+               size, first_data_block, last_data_block);
 }
 
 const void DIR_HANDLE::print() const {
@@ -1003,8 +2530,8 @@ const void DIR_HANDLE::toString(char* buffer, uint8_t size_buf) const {
 
     
 	snprintf_P(buffer, size_buf, 
-		       PSTR("dir_block: %i, next_file: %u"), 
-	           block_num, next_file_block);
+		       PSTR("dir_block: %i, bucket: %u, next_file: %u"), 
+	           block_num, bucket, next_file_block);
 }
 
 #endif
\ No newline at end of file
@@ -19,21 +19,55 @@
 #define I2CFS_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include "i2cfs_config.h"
+#include "i2cfs_devices.h"
+#include "i2cfs_trace.h"
 
-typedef char     FILENAME[32];
+typedef char     FILENAME[I2CFS_NAME_LENGTH];
+
+#if I2CFS_BLOCK_BITS == 32
+typedef uint32_t BLOCK;
+#elif I2CFS_BLOCK_BITS == 16
 typedef uint16_t BLOCK;
+#else
+    #error I2CFS_BLOCK_BITS must be 16 or 32
+#endif
+
+#define BLOCK_SIZE I2CFS_BLOCK_SIZE
+
+// With a link table data blocks are all data, otherwise they start with
+// the number of the next one
+
+#if I2CFS_FAT_TABLE
+#define DATA_OFFSET ((size_t) 0)      // Unsigned like sizeof, for min() with sizes
+#else
+#define DATA_OFFSET sizeof(BLOCK)
+#endif
+
+#define DATA_SIZE  (BLOCK_SIZE - DATA_OFFSET)
+
+// Offset inside a block, up to BLOCK_SIZE included
+
+#if BLOCK_SIZE < 256
+typedef uint8_t  BLOCK_OFFSET;
+#else
+typedef uint16_t BLOCK_OFFSET;
+#endif
 
 struct MasterBlock {
 
-  uint16_t total_blocks;              // Total Blocks of 64bytes this EEPROM has
-  uint16_t used_blocks;               // Total of used blocks
+  BLOCK    total_blocks;              // Total Blocks of BLOCK_SIZE bytes of the volume
+  BLOCK    used_blocks;               // Total of used blocks
   BLOCK    first_used_block;          // Number of first used block (ZERO if none)
   BLOCK    last_used_block;
   BLOCK    first_free_block;          // Number of first free block (ZERO if none)
   BLOCK    last_free_block;
-  BLOCK    first_file_block;          // Number of first block that is a file 
   BLOCK    first_directory_block;     // Number of first block that is a directory
+  uint8_t  flags;                     // FS_FLAG_*
+  BLOCK    next_fresh_block;          // First block never allocated, all above it are
+                                      // free too and have no link (ZERO if none)
+  BLOCK    root_files[I2CFS_DIR_BUCKETS]; // File chains of the root directory
 
   #ifdef SERIAL_DEBUG
   const void print(char op) const;
@@ -52,6 +86,7 @@ struct DirectoryBlock {
   BLOCK    next_dir_block;           // Number of the next used block
   BLOCK    previous_dir_block;       // Number of the previous used block
   FILENAME name;                      // Name of the file
+  BLOCK    files[I2CFS_DIR_BUCKETS];  // First file of each chain (ZERO if none)
 
   #ifdef SERIAL_DEBUG
   const void print(char op) const;
@@ -63,15 +98,16 @@ struct DirectoryBlock {
 struct FileBlock {
 
   BLOCK    this_block;
-  BLOCK    next_file_block;
-  BLOCK    previous_file_block;
+  BLOCK    next_file_block;           // Next file of the same directory and chain
+  BLOCK    previous_file_block;       // ZERO for the first, held by the directory
   BLOCK    parent_directory;          // Number of parent directory
   uint32_t size;                      // Size in bytes of file
   uint32_t num_data_blocks;           // Number of data blocks
   BLOCK    first_data_block;          // Number of the first data block of this file
   BLOCK    last_data_block;
-  uint8_t  attributes;
-  FILENAME name;                      // Name of the file
+  uint8_t  attributes;                // FS_ATTR_*
+  FILENAME name;                      // Name of the file, the data of an inline file
+                                      // follows its NUL up to the end of the block
 
   #ifdef SERIAL_DEBUG
   const void print(char op) const;
@@ -86,8 +122,10 @@ struct FileBlock {
 
 struct DataBlock {
   
+  #if !I2CFS_FAT_TABLE
   BLOCK    next_data_block;           // Number of the next data block (ZERO if none)
-  uint8_t  data[62];
+  #endif
+  uint8_t  data[DATA_SIZE];
 
   #ifdef SERIAL_DEBUG
   const void print(char op, BLOCK this_block) const;
@@ -117,10 +155,23 @@ struct FILE_HANDLE {
   BLOCK      block_num;
   FILE_MODE  mode;
   BLOCK      next_data_block;
-  uint8_t    position_in_block;
+  BLOCK_OFFSET position_in_block;
   uint32_t   size;
   uint32_t   position;
   BLOCK      first_data_block;
+  BLOCK      last_data_block;
+  BLOCK      link_of;                 // Block whose link is held in link (ZERO if none)
+  BLOCK      link;
+  BLOCK_OFFSET inline_at;             // Offset of the data in the file block while the file
+                                      // fits there (ZERO once it has data blocks)
+  uint8_t*   write_buffer;            // Set by I2CFS::set_write_buffer() (ZERO if none)
+  uint16_t   write_buffer_size;
+  uint16_t   write_buffered;          // Bytes before position not written yet
+
+  #if I2CFS_SEEK_POINTS
+  BLOCK      seek_stride;                          // Data blocks between seek points
+  BLOCK      seek_points[I2CFS_SEEK_POINTS];       // Block at index (i + 1) * seek_stride,
+  #endif                                           // ZERO until a seek passed it
 
   #ifdef SERIAL_DEBUG
   const void print() const;
@@ -134,6 +185,7 @@ struct DIR_HANDLE  {
   BLOCK    block_num;
   BLOCK    next_file_block;
   uint32_t pos;
+  uint8_t  bucket;                    // File chain being listed
 
   #ifdef SERIAL_DEBUG
   const void print() const;
@@ -143,12 +195,61 @@ struct DIR_HANDLE  {
     
 } __attribute__((__packed__));
 
+#define FS_FLAG_DIRTY  0x01           // Counters changed since the last sync()
+
+#define FS_ATTR_INLINE 0x01           // Data held in the file block, after the name
+
+#define FAT_END        ((BLOCK) ~0)   // Link table entry of a block in use with no next,
+                                      // ZERO is a free block
+
 typedef uint8_t   FS_STATUS;
 typedef FileBlock FILE_ENTRY;
 typedef DirectoryBlock DIR_ENTRY;
 
-#define BLOCK_SIZE 64
-#define DATA_SIZE  (BLOCK_SIZE - sizeof(BLOCK))
+// Layouts checked against the geometry of the build
+
+static_assert(BLOCK_SIZE >= 32 && BLOCK_SIZE <= 256 && !(BLOCK_SIZE & (BLOCK_SIZE - 1)),
+              "I2CFS_BLOCK_SIZE must be 32, 64, 128 or 256");
+static_assert(sizeof(MasterBlock) <= BLOCK_SIZE,
+              "MasterBlock does not fit a block, fewer I2CFS_DIR_BUCKETS or larger blocks");
+static_assert(sizeof(DirectoryBlock) <= BLOCK_SIZE,
+              "DirectoryBlock does not fit a block, shorter names or larger blocks");
+static_assert(sizeof(FileBlock) <= BLOCK_SIZE,
+              "FileBlock does not fit a block, shorter names or larger blocks");
+static_assert(sizeof(DataBlock) == BLOCK_SIZE, "DataBlock must fill a block");
+
+/*
+ * Block held by the write-back cache
+ *
+ * Bytes [0, valid) match the chip or hold newer data, bytes [dirty_from,
+ * dirty_to) are newer than the chip and go back on flush or eviction.
+ */
+
+struct CacheEntry {
+
+  BLOCK    block_num;                 // ZERO if slot is empty
+  uint8_t  rank;                      // 0 is the most recently used
+  BLOCK_OFFSET valid;
+  BLOCK_OFFSET dirty_from;
+  BLOCK_OFFSET dirty_to;              // ZERO if clean
+  uint8_t  data[BLOCK_SIZE];
+
+}  __attribute__((__packed__));
+
+/*
+ * Name kept in the RAM name table
+ *
+ * Directories are entered with parent equal to their own block, which no
+ * file can have.
+ */
+
+struct NameEntry {
+
+  uint16_t hash;
+  BLOCK    parent;                    // Directory of a file, ZERO for the root
+  BLOCK    block_num;
+
+}  __attribute__((__packed__));
 
 #define FS_STATUS_OK                    0
 #define FS_STATUS_INVALID_FILE_NAME     1
@@ -159,6 +260,7 @@ typedef DirectoryBlock DIR_ENTRY;
 #define FS_STATUS_INVALID_SEEK          6
 #define FS_STATUS_END_OF_FILE           7
 #define FS_STATUS_INVALID_HANDLE        8
+#define FS_STATUS_PENDING               9
 
 class I2CFS
 {
@@ -183,40 +285,116 @@ class I2CFS
   MasterBlock     master_block;
   BLOCK           next_dir_block;
   
-  bool       read_block(uint16_t block_num, uint16_t size);
-  bool       write_block(uint16_t block_num, uint16_t size);
+  #if I2CFS_CACHE_BLOCKS
+  CacheEntry cache[I2CFS_CACHE_BLOCKS];
+
+  CacheEntry* cache_find(BLOCK block_num);
+  CacheEntry* cache_alloc(BLOCK block_num);
+  void        cache_touch(CacheEntry* entry);
+  bool        cache_fill(CacheEntry* entry, BLOCK_OFFSET upto);
+  bool        cache_write_back(CacheEntry* entry);
+  void        cache_invalidate();
+  #endif
+
+  bool       device_read(BLOCK block_num, BLOCK_OFFSET offset, void* buffer, uint16_t size);
+  bool       device_write(BLOCK block_num, BLOCK_OFFSET offset, void* buffer, uint16_t size);
+
+  bool       read_block(BLOCK block_num, uint16_t size);
+  bool       write_block(BLOCK block_num, uint16_t size);
 
-  bool       read_block_ex(uint16_t block_num, uint8_t offset, void* buffer, uint16_t size);
-  bool       write_block_ex(uint16_t block_num, uint8_t offset, void* buffer, uint16_t size);
+  bool       read_block_ex(BLOCK block_num, BLOCK_OFFSET offset, void* buffer, uint16_t size);
+  bool       write_block_ex(BLOCK block_num, BLOCK_OFFSET offset, void* buffer, uint16_t size);
 
-  bool       read_block_type_free(uint16_t block_num);
-  bool       write_block_type_free(uint16_t block_num);
+  bool       read_block_type_free(BLOCK block_num);
+  bool       write_block_type_free(BLOCK block_num);
 
-  bool       read_block_type_file(uint16_t block_num);
-  bool       write_block_type_file(uint16_t block_num);
+  bool       read_block_type_file(BLOCK block_num);
+  bool       write_block_type_file(BLOCK block_num);
 
-  bool       read_block_type_dir(uint16_t block_num);
-  bool       write_block_type_dir(uint16_t block_num);
+  bool       read_block_type_dir(BLOCK block_num);
+  bool       write_block_type_dir(BLOCK block_num);
 
-  bool       read_block_type_data(uint16_t block_num);
-  bool       write_block_type_data(uint16_t block_num);
+  bool       read_block_type_data(BLOCK block_num);
+  bool       write_block_type_data(BLOCK block_num);
 
   BLOCK      get_one_free_block();
+  BLOCK      get_data_block(BLOCK& run, uint8_t& run_left, uint32_t bytes);
   void       release_one_used_block(BLOCK used_block);
-  void       release_data_blocks(BLOCK first_block);
+  void       release_data_blocks(FILE_ENTRY& file_entry);
 
   BLOCK      find_dir_block_by_name(const char *name);
 
+  uint16_t   name_hash(const char* name);
+  uint8_t    name_bucket(const char* name);
+  BLOCK      bucket_head(BLOCK dir_block, uint8_t bucket);
+  void       set_bucket_head(BLOCK dir_block, uint8_t bucket, BLOCK head);
+  void       erase_file_entry(FILE_ENTRY& file_entry);
+
+  #if I2CFS_NAME_TABLE
+  NameEntry  names[I2CFS_NAME_TABLE];
+  uint16_t   name_count;
+  bool       names_complete;           // Every name on the volume is in the table
+
+  void       build_name_table();
+  void       name_table_add(const char* name, BLOCK parent, BLOCK block_num);
+  void       name_table_remove(BLOCK block_num);
+  #endif
+
   FS_STATUS truncate_file_entry(FILE_ENTRY& file_entry);
   FS_STATUS create_file_entry(DIR_HANDLE& dir_handle,
                               const char *name,
                               FILE_ENTRY& file_entry);
   
+  #if I2CFS_FREE_BITMAP
+  uint8_t    bitmap[I2CFS_FREE_BITMAP]; // Bit set = block in use, kept in blocks 1..
+  uint16_t   bitmap_dirty_from;
+  uint16_t   bitmap_dirty_to;          // ZERO if clean
+  BLOCK      bitmap_cursor;            // Where the search for free blocks starts
+
+  uint16_t   bitmap_blocks();
+  void       bitmap_set(BLOCK block_num, bool used);
+  uint8_t    find_free_run(BLOCK& first, uint8_t wanted);
+  BLOCK      get_free_run(uint8_t wanted, uint8_t& got);
+  bool       read_bitmap();
+  bool       save_bitmap();
+  #endif
+
+  #if I2CFS_FAT_TABLE
+  BLOCK      fat[I2CFS_FAT_TABLE / sizeof(BLOCK)]; // Link of each block, kept in blocks 1..
+  uint16_t   fat_dirty_from;
+  uint16_t   fat_dirty_to;             // ZERO if clean
+  BLOCK      fat_cursor;               // Where the search for free blocks starts
+
+  uint16_t   fat_blocks();
+  void       fat_set(BLOCK block_num, BLOCK entry);
+  bool       read_fat();
+  bool       save_fat();
+  #endif
+
+  BLOCK      get_link(BLOCK block_num);
+  void       set_link(BLOCK block_num, BLOCK next);
+
+  uint32_t      device_blocks;          // Blocks of the chips given to begin()
+  uint8_t       device_chips;           // Chips the blocks are striped across
+  uint8_t       chip_addr[8];           // Device address of each of them
+  uint8_t       master_changes;         // Allocations not written back yet
+  unsigned long master_changed_at;
+
   bool       read_master_block();
   bool       save_master_block();
+  void       touch_master_block();
+  void       sync_if_due();
+  void       mark_block(uint8_t* map, BLOCK block_num);
+  bool       block_marked(uint8_t* map, BLOCK block_num);
 
   void       clear_temp_block();
-  BLOCK      append_new_data_block(BLOCK file_block, BLOCK last_data_block);
+  BLOCK      find_data_block(FILE_HANDLE& file_handle, BLOCK index);
+  FS_STATUS  write_data(FILE_HANDLE& file_handle, uint8_t* pointer, uint32_t size, uint32_t* really_write);
+  FS_STATUS  flush_write_buffer(FILE_HANDLE& file_handle);
+  void       write_inline(FILE_HANDLE& file_handle, uint8_t* pointer, uint32_t size);
+  FS_STATUS  spill_inline(FILE_HANDLE& file_handle);
+  void       write_stripe(BLOCK* blocks, uint8_t count, BLOCK next_block, uint8_t* data);
+  FS_STATUS  append_data_blocks(FILE_HANDLE& file_handle, uint8_t*& pointer, uint32_t& size, uint32_t* really_write);
   void       file_handle_from_file_entry(FILE_HANDLE& file_handle, FILE_ENTRY& file_entry, uint32_t seek_pos);
 
   /*
@@ -236,13 +414,26 @@ class I2CFS
    * Before using a I2CFS you must format it so the free blocks list and
    * used blocks list can be initiated to default values
    *
+   * Only the master block is written: blocks never used since the format
+   * are handed out from a high-water mark, so formatting takes the same
+   * time on any chip size
+   *
    * @param bits_size Size in bits for the I2C memory this file system will
    * handle
    */
 
    I2CFS();
 
-   void      begin (uint8_t addr);
+   /**
+    * Mounts the file system of the chip at I2C address addr
+    *
+    * @param profile Geometry and timing of the chip, see i2cfs_devices.h
+    * @param chips   Identical chips at addr, addr + 1, ... the volume is
+    * striped across, block by block (addresses taken by the block select
+    * bits of parts over 64 KB are skipped). Format with their total size
+    */
+
+   void      begin (uint8_t addr, const DEVICE_PROFILE& profile = DEVICE_24LC256, uint8_t chips = 1);
    FS_STATUS format(uint16_t size_in_KB);
 
    FS_STATUS directory_exists(const char *name);
@@ -269,12 +460,89 @@ class I2CFS
                    DIR_HANDLE& dir_handle, 
                    FILE_HANDLE& file_handle);
 
-   FS_STATUS read(FILE_HANDLE& file_handle, void* buffer, uint16_t size, uint16_t* really_read, bool has_delimiter, char delimiter);
-   FS_STATUS read(FILE_HANDLE& file_handle, void* buffer, uint16_t size, uint16_t* really_read);
-   FS_STATUS read(FILE_HANDLE& file_handle, void* buffer, uint16_t size, uint16_t* really_read, char delimiter);
-   FS_STATUS write(FILE_HANDLE& file_handle, void* buffer, uint16_t size, uint16_t* really_write);
+   FS_STATUS read(FILE_HANDLE& file_handle, void* buffer, uint32_t size, uint32_t* really_read, bool has_delimiter, char delimiter);
+   FS_STATUS read(FILE_HANDLE& file_handle, void* buffer, uint32_t size, uint32_t* really_read);
+   FS_STATUS read(FILE_HANDLE& file_handle, void* buffer, uint32_t size, uint32_t* really_read, char delimiter);
+   FS_STATUS write(FILE_HANDLE& file_handle, void* buffer, uint32_t size, uint32_t* really_write);
 
    FS_STATUS close(FILE_HANDLE& file_handle);
+
+   /**
+    * Writes back every block changed in the block cache
+    *
+    * Metadata and data updates wait in RAM until their cache slot is
+    * needed, until close() or until this is called. With I2CFS_FAT_TABLE
+    * the links changed in the table are written too, so what was flushed
+    * is found again when begin() recovers from a power loss.
+    */
+
+   FS_STATUS flush();
+
+   /**
+    * Writes what the write buffer of file_handle holds, then the block cache
+    */
+
+   FS_STATUS flush(FILE_HANDLE& file_handle);
+
+   /**
+    * Gathers small appends to file_handle in buffer
+    *
+    * Writes at the end of the file are copied to buffer and reach the chip
+    * when it is full up to a data block boundary, on seek(), read(),
+    * close() or flush(file_handle). Size it to the page of the chip or to
+    * a few data blocks; a buffer of size 0 or a ZERO pointer detaches it.
+    * Call after open(), which detaches any buffer.
+    *
+    * write() counts the bytes it buffered as written. When a flush finds
+    * the disk full, the call that made it returns FS_STATUS_DISK_FULL and
+    * the bytes that did not fit stay buffered, counted in write_buffered
+    * of the handle: its size less write_buffered is what the chip holds.
+    * Each later flush tries them again; close() drops them.
+    */
+
+   FS_STATUS set_write_buffer(FILE_HANDLE& file_handle, void* buffer, uint16_t size);
+
+   /**
+    * Writes back the block cache and the allocation counters
+    *
+    * Allocating or releasing blocks changes the free list head and the
+    * used block count of the master block. They are kept in RAM and
+    * written back here, on close(), or after I2CFS_SYNC_OPS changes or
+    * I2CFS_SYNC_MS milliseconds. Directory and file chain heads are still
+    * written right away.
+    */
+
+   FS_STATUS sync();
+
+   /**
+    * Drives the writes of the driver's write queue (I2C_WRITE_QUEUE)
+    *
+    * Call it from loop() or a timer. Sends the queued page writes whose
+    * chip is not in a write cycle and returns right away: FS_STATUS_PENDING
+    * while writes are queued or running, FS_STATUS_OK once they all reached
+    * the array. Reads see queued data before it is written. Changes still
+    * in the block cache are queued by flush() or close().
+    */
+
+   FS_STATUS poll();
+
+   /**
+    * Function poll() calls when the queued writes have all completed
+    */
+
+   void      set_write_callback(void (*callback)());
+
+   /**
+    * Rebuilds the free list and the used block count from the directory,
+    * file and data chains
+    *
+    * begin() runs it when the chip lost power with changes not synced.
+    * Every free block below the last block in use gets its link written
+    * again, the ones above become fresh blocks.
+    */
+
+   FS_STATUS recover();
+
    FS_STATUS truncate(FILE_HANDLE& file_handle);
    FS_STATUS erase(DIR_HANDLE& dir_handle, const char* name);
   /**
@@ -3,18 +3,108 @@
 #ifndef I2CFS_CONFIG_H
 #define I2CFS_CONFIG_H
 
-#define SERIAL_DEBUG
+#ifdef I2CFS_SERIAL_DEBUG
+#define SERIAL_DEBUG   // Text logging of every block over Serial, only in builds
+#endif                 // that define I2CFS_SERIAL_DEBUG: it slows them down by
+                       // orders of magnitude, I2CFS_TRACE does not
 #undef  READ_ONLY      // Do no compile the code of all methods that write data
                        // This do the code smaller if you want just read the 
                        // File System
 
-#define DRIVER_I2C     
-#undef  DRIVER_EEPROM
-#undef  DRIVER_SPI
+#ifndef I2CFS_TRACE
+#define I2CFS_TRACE 0          // Records of the RAM trace ring (12 bytes each), see
+#endif                         // i2cfs_trace.h. 0 leaves tracing out
+
+#ifndef I2CFS_CACHE_BLOCKS
+#define I2CFS_CACHE_BLOCKS 4   // Blocks kept in RAM by the write-back block cache
+#endif                         // (BLOCK_SIZE + 5 bytes each), 0 leaves it out
+
+#ifndef I2CFS_SYNC_OPS
+#define I2CFS_SYNC_OPS 32      // Block allocations and releases kept in RAM before
+#endif                         // the master block is written back by sync()
+
+#ifndef I2CFS_SYNC_MS
+#define I2CFS_SYNC_MS  0       // Or milliseconds since the first of them, 0 = no
+#endif                         // time budget
+
+#ifndef I2CFS_DIR_BUCKETS
+#define I2CFS_DIR_BUCKETS 8    // File chains of each directory, chosen by a hash of
+#endif                         // the name (up to 13 fit a DirectoryBlock). Format
+                               // again after changing it
+
+#ifndef I2CFS_NAME_TABLE
+#define I2CFS_NAME_TABLE 0     // Files and directories whose name hash begin() keeps
+#endif                         // in RAM (6 bytes each) so lookups read one block at
+                               // most, 0 = none
+
+#ifndef I2CFS_SEEK_POINTS
+#define I2CFS_SEEK_POINTS 4    // Blocks each FILE_HANDLE remembers along its file so
+#endif                         // seek() does not walk from the start, 0 = none
+
+#ifndef I2CFS_INLINE_FILES
+#define I2CFS_INLINE_FILES 1   // Files that fit after the name in their file block
+#endif                         // are kept there instead of in a data block. Every
+                               // build reads them, 0 only stops making new ones
+
+#ifndef I2CFS_FREE_BITMAP
+#define I2CFS_FREE_BITMAP 0    // Bytes of a RAM bitmap of used blocks (1 bit each, 64
+#endif                         // for a 24LC256) kept in blocks 1.. instead of the
+                               // on-disk free list, 0 = free list. Format again
+                               // after changing it
+
+#ifndef I2CFS_BLOCK_SIZE
+#define I2CFS_BLOCK_SIZE  64   // Bytes of a block: 32, 64, 128 or 256. Larger blocks
+#endif                         // suit 128 and 256 byte page parts, with fewer chain
+                               // hops per KB. 32 only fits the metadata with an
+                               // I2CFS_NAME_LENGTH of 11 and at most 7
+                               // I2CFS_DIR_BUCKETS. Format again after changing it
+
+#ifndef I2CFS_NAME_LENGTH
+#define I2CFS_NAME_LENGTH 32   // Bytes of a file or directory name, NUL included
+#endif
+
+#ifndef I2CFS_BLOCK_BITS
+#define I2CFS_BLOCK_BITS  16   // Width of a block number, 16 or 32. 32 needs 128 byte
+#endif                         // blocks for the metadata to fit
+
+#ifndef I2CFS_FAT_TABLE
+#define I2CFS_FAT_TABLE 0      // Bytes of a RAM table of block links (2 bytes a block,
+#endif                         // 1 KB for 512 blocks) kept in blocks 1.., so data blocks
+                               // hold BLOCK_SIZE bytes of data and chains are followed
+                               // in RAM. 0 = links in the data blocks. Format again
+                               // after changing it
+
+#if I2CFS_FAT_TABLE && I2CFS_FREE_BITMAP
+    #error I2CFS_FAT_TABLE tracks free blocks itself, leave I2CFS_FREE_BITMAP at 0
+#endif
+
+#if !defined(DRIVER_SPI) && !defined(DRIVER_EEPROM)
+#define DRIVER_I2C             // Block device backend: DRIVER_I2C (24LCxx, AT24C,
+#endif                         // FM24 FRAM) or DRIVER_SPI (25LCxx, FM25/MB85RS FRAM).
+                               // I2CFS calls it through the driver_ names below
+
+#ifdef DRIVER_EEPROM
+    #error DRIVER_EEPROM is not implemented, use DRIVER_I2C or DRIVER_SPI
+#endif
 
 #ifdef DRIVER_I2C
-    #define driver_write i2c_write_buffer
-    #define driver_read  i2c_read_buffer
+    #define driver_write       i2c_write_buffer
+    #define driver_read        i2c_read_buffer
+    #define driver_set_profile i2c_set_profile
+    #define driver_wait        i2c_wait_idle
+    #define driver_poll        i2c_poll
+    #define driver_set_callback i2c_set_callback
+    #define driver_write_span  i2c_write_span
+#endif
+
+#ifdef DRIVER_SPI
+    #define driver_write       spi_write_buffer
+    #define driver_read        spi_read_buffer
+    #define driver_set_profile spi_set_profile
+    #define driver_wait        spi_wait_idle
+    #define driver_poll        spi_poll
+    #define driver_set_callback spi_set_callback
+    #define driver_write_span  spi_write_span
 #endif
 
 #ifdef ESP8266
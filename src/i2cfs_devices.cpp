@@ -0,0 +1,28 @@
+#include "i2cfs_devices.h"
+
+//                                          size    page  tWC  select
+
+const DEVICE_PROFILE DEVICE_24LC64     = {   8192,   32,   5,  0x00 };
+const DEVICE_PROFILE DEVICE_24LC128    = {  16384,   64,   5,  0x00 };
+const DEVICE_PROFILE DEVICE_24LC256    = {  32768,   64,   5,  0x00 };
+const DEVICE_PROFILE DEVICE_24LC512    = {  65536,  128,   5,  0x00 };
+const DEVICE_PROFILE DEVICE_24LC1025   = { 131072,  128,   5,  0x04 };
+const DEVICE_PROFILE DEVICE_24CM02     = { 262144,  256,  10,  0x03 };
+
+const DEVICE_PROFILE DEVICE_25LC256    = {  32768,   64,   5,  0x00 };
+const DEVICE_PROFILE DEVICE_25LC1024   = { 131072,  256,   6,  0x00 };
+
+const DEVICE_PROFILE DEVICE_AT24C32    = {   4096,   32,  10,  0x00 };
+const DEVICE_PROFILE DEVICE_AT24C64    = {   8192,   32,  10,  0x00 };
+const DEVICE_PROFILE DEVICE_AT24C128   = {  16384,   64,   5,  0x00 };
+const DEVICE_PROFILE DEVICE_AT24C256   = {  32768,   64,   5,  0x00 };
+const DEVICE_PROFILE DEVICE_AT24C512   = {  65536,  128,   5,  0x00 };
+const DEVICE_PROFILE DEVICE_AT24CM01   = { 131072,  256,   5,  0x01 };
+const DEVICE_PROFILE DEVICE_AT24CM02   = { 262144,  256,  10,  0x03 };
+
+const DEVICE_PROFILE DEVICE_FM24CL64   = {   8192, 8192,   0,  0x00 };
+const DEVICE_PROFILE DEVICE_MB85RC256V = {  32768, 32768,  0,  0x00 };
+
+const DEVICE_PROFILE DEVICE_FM25V02    = {  32768, 32768,  0,  0x00 };
+const DEVICE_PROFILE DEVICE_MB85RS256  = {  32768, 32768,  0,  0x00 };
+const DEVICE_PROFILE DEVICE_FM25V10    = { 131072, 32768,  0,  0x00 };
@@ -0,0 +1,71 @@
+/*
+ * Geometry and timing of the memory chips i2cfs runs on
+ *
+ * A profile tells the driver how big the array is, how many bytes one page
+ * write can take before the address rolls over inside the page, and how long
+ * the chip may need for its internal write cycle. Pass one to I2CFS::begin()
+ * to match the chip soldered on the board.
+ *
+ * How many bytes fit in one bus transaction is not a property of the chip
+ * but of the Wire library of the MCU, see I2C_WIRE_BUFFER in i2cutils.h.
+ *
+ * Parts over 64 KB still take a 16-bit memory address: the bits above it
+ * (block select) go in the device address, in the bits of select_bits. The
+ * chip answers on all those addresses and its address counter rolls over
+ * inside each 64 KB bank.
+ *
+ * FRAM has no pages and no write cycle: its page_size only bounds one write
+ * and its tWC is 0, so the driver never waits for it. The FM25/MB85RS and
+ * 25LCxx parts need DRIVER_SPI in i2cfs_config.h, the others DRIVER_I2C.
+ */
+
+#ifndef I2CFS_DEVICES_H
+#define I2CFS_DEVICES_H
+
+#include <stdint.h>
+
+struct DEVICE_PROFILE {
+
+  uint32_t size;                      // Size of array in bytes
+  uint16_t page_size;                 // Bytes of one page write (power of 2)
+  uint8_t  write_cycle_ms;            // Maximum internal write cycle time (tWC)
+  uint8_t  select_bits;               // Device address bits taking A16 and up, 0 if none
+
+};
+
+// Microchip
+
+extern const DEVICE_PROFILE DEVICE_24LC64;       //   8 KB,  32 byte page, 5 ms
+extern const DEVICE_PROFILE DEVICE_24LC128;      //  16 KB,  64 byte page, 5 ms
+extern const DEVICE_PROFILE DEVICE_24LC256;      //  32 KB,  64 byte page, 5 ms
+extern const DEVICE_PROFILE DEVICE_24LC512;      //  64 KB, 128 byte page, 5 ms
+extern const DEVICE_PROFILE DEVICE_24LC1025;     // 128 KB, 128 byte page, 5 ms, A16 in bit 2
+extern const DEVICE_PROFILE DEVICE_24CM02;       // 256 KB, 256 byte page, 10 ms, A17-A16 in bits 1-0
+
+// Microchip SPI EEPROM
+
+extern const DEVICE_PROFILE DEVICE_25LC256;      //  32 KB,  64 byte page, 5 ms
+extern const DEVICE_PROFILE DEVICE_25LC1024;     // 128 KB, 256 byte page, 6 ms
+
+// Atmel / Microchip AT24C
+
+extern const DEVICE_PROFILE DEVICE_AT24C32;      //   4 KB,  32 byte page, 10 ms
+extern const DEVICE_PROFILE DEVICE_AT24C64;      //   8 KB,  32 byte page, 10 ms
+extern const DEVICE_PROFILE DEVICE_AT24C128;     //  16 KB,  64 byte page, 5 ms
+extern const DEVICE_PROFILE DEVICE_AT24C256;     //  32 KB,  64 byte page, 5 ms
+extern const DEVICE_PROFILE DEVICE_AT24C512;     //  64 KB, 128 byte page, 5 ms
+extern const DEVICE_PROFILE DEVICE_AT24CM01;     // 128 KB, 256 byte page, 5 ms, A16 in bit 0
+extern const DEVICE_PROFILE DEVICE_AT24CM02;     // 256 KB, 256 byte page, 10 ms, A17-A16 in bits 1-0
+
+// FRAM, I2C
+
+extern const DEVICE_PROFILE DEVICE_FM24CL64;     //   8 KB, no write cycle
+extern const DEVICE_PROFILE DEVICE_MB85RC256V;   //  32 KB, no write cycle
+
+// FRAM, SPI
+
+extern const DEVICE_PROFILE DEVICE_FM25V02;      //  32 KB, no write cycle
+extern const DEVICE_PROFILE DEVICE_MB85RS256;    //  32 KB, no write cycle
+extern const DEVICE_PROFILE DEVICE_FM25V10;      // 128 KB, no write cycle
+
+#endif
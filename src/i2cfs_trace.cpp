@@ -0,0 +1,50 @@
+#include <Arduino.h>
+#include "i2cfs_trace.h"
+
+#if I2CFS_TRACE
+
+static TRACE_RECORD ring[I2CFS_TRACE];
+static uint16_t     head;               // Slot of the next record
+static uint32_t     total;              // Records since the last clear
+
+void trace(uint8_t op, uint32_t block, uint8_t offset, uint16_t length)
+{
+  TRACE_RECORD& record = ring[head];
+
+  record.time_us = micros();
+  record.block   = block;
+  record.length  = length;
+  record.offset  = offset;
+  record.op      = op;
+
+  if(++head == I2CFS_TRACE) head = 0;
+  total++;
+}
+
+uint16_t trace_count()
+{
+  return total < I2CFS_TRACE ? total : I2CFS_TRACE;
+}
+
+const TRACE_RECORD* trace_get(uint16_t i)
+{
+  // Record i of those kept, 0 the oldest
+
+  uint16_t slot = total < I2CFS_TRACE ? i : head + i;
+
+  if(slot >= I2CFS_TRACE) slot -= I2CFS_TRACE;
+  return &ring[slot];
+}
+
+uint32_t trace_lost()
+{
+  return total - trace_count();
+}
+
+void trace_clear()
+{
+  head  = 0;
+  total = 0;
+}
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef I2CFS_TRACE_H
+#define I2CFS_TRACE_H
+
+#include <stdint.h>
+#include "i2cfs_config.h"
+
+/*
+ * Binary trace of file system activity
+ *
+ * With I2CFS_TRACE set to a number of records every bus transfer, cache
+ * hit, allocation and file operation stores one fixed size record in a RAM
+ * ring: no formatting and no Serial, so the timing traced is the timing of
+ * a release build. The oldest records are overwritten. Left at 0 the trace
+ * calls compile to nothing.
+ *
+ * A dump is the records oldest first, as they are in RAM (little endian on
+ * AVR, ESP and the host):
+ *
+ *     for(uint16_t i = 0; i < trace_count(); i++) {
+ *         Serial.write((const uint8_t*) trace_get(i), sizeof(TRACE_RECORD));
+ *     }
+ *
+ * extras/host/i2cfs_decode turns a dump into a timeline.
+ */
+
+struct TRACE_RECORD {
+
+  uint32_t time_us;                   // micros() when the event happened
+  uint32_t block;                     // Block, meaning given by op
+  uint16_t length;                    // Bytes, or count given by op
+  uint8_t  offset;                    // Offset in the block, or detail given by op
+  uint8_t  op;                        // TRACE_*
+
+}  __attribute__((__packed__));
+
+//                                       block           offset        length
+#define TRACE_READ      1             // block read      offset        bytes read from the chip
+#define TRACE_WRITE     2             // block written   offset        bytes written to the chip
+#define TRACE_CACHED    3             // block read      offset        bytes found in the cache
+#define TRACE_ALLOC     4             // block taken
+#define TRACE_RELEASE   5             // first freed                   blocks freed
+#define TRACE_OPEN      6             // file block      FILE_MODE
+#define TRACE_CLOSE     7             // file block
+#define TRACE_SEEK      8             // data block      in block
+#define TRACE_SYNC      9             //                               changes synced
+#define TRACE_FORMAT    10            // total blocks
+#define TRACE_RECOVER   11            // total blocks                  used blocks found
+
+#if I2CFS_TRACE
+
+void                trace(uint8_t op, uint32_t block, uint8_t offset, uint16_t length);
+uint16_t            trace_count();
+const TRACE_RECORD* trace_get(uint16_t i);
+uint32_t            trace_lost();
+void                trace_clear();
+
+  #define I2CFS_TRACE_EVENT(op, block, offset, length) trace(op, block, offset, length);
+#else
+  #define I2CFS_TRACE_EVENT(op, block, offset, length)
+#endif
+
+#endif
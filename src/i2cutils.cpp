@@ -1,10 +1,251 @@
 #include "i2cutils.h"
 
-// ---------------------------------------------------------------------------------------------
+I2C_STATS i2c_stats;
+
+// Mirror of the chips' internal address counter, one per device address
+// (A2..A0). A read that starts where the last one ended is sent as a
+// current address read, with no address phase
+
+static uint32_t next_address[8];
+static uint8_t  next_address_valid;
+
+#define DEVICE_BIT(deviceaddress) (1 << ((deviceaddress) & 0x07))
+
+// Profile of the chip at each device address, set by i2c_set_profile().
+// Volumes of different parts can be mounted at the same time
+
+static const DEVICE_PROFILE* profiles[8];
+
+static const DEVICE_PROFILE* i2c_profile(int deviceaddress)
+{
+  const DEVICE_PROFILE* profile = profiles[deviceaddress & 0x07];
+  return profile ? profile : &DEVICE_24LC256;
+}
 
-void i2c_set_address(int deviceaddress, unsigned int eeaddress, bool close)
+// Chips whose write cycle may still run. The driver does not wait after a
+// page write but before the next access to the same chip, so the write
+// cycles of several chips overlap
+
+static uint8_t busy;
+static uint8_t busy_address[8];         // Device address behind each bit of busy
+
+// Device address of the bank of eeaddress on parts over 64 KB, which take
+// the memory address bits above 16 in the select bits of the profile
+
+static int i2c_device(int deviceaddress, uint32_t eeaddress)
 {
+  uint8_t select = i2c_profile(deviceaddress)->select_bits;
+  uint8_t shift  = 0;
+
+  if(!select) return deviceaddress;
+  while(!(select & (1 << shift))) shift++;
+
+  return deviceaddress | (((eeaddress >> 16) << shift) & select);
+}
+
+static bool i2c_settle(int deviceaddress)
+{
+  uint8_t device_bit = DEVICE_BIT(deviceaddress);
+
+  if(!(busy & device_bit)) return true;
+  busy &= ~device_bit;
+  return i2c_wait_ready(deviceaddress);
+}
+
+// Same without waiting: one ACK poll if the chip may still be busy
+
+static bool i2c_idle(int deviceaddress)
+{
+  uint8_t device_bit = DEVICE_BIT(deviceaddress);
+
+  if(!(busy & device_bit)) return true;
+
   Wire.beginTransmission(deviceaddress);
+  if(Wire.endTransmission() != 0) return false;
+
+  busy &= ~device_bit;
+  return true;
+}
+
+static void i2c_page_write(int deviceaddress, uint32_t eeaddress, uint8_t* data, uint16_t length)
+{
+  // After a page write the counter has rolled inside the page, let the
+  // next read address the chip again
+
+  next_address_valid &= ~DEVICE_BIT(deviceaddress);
+
+  i2c_set_address(deviceaddress, eeaddress, false);
+  Wire.write(data, length);
+  Wire.endTransmission();
+  i2c_stats.write_cycles++;
+
+  // FRAM stores the data as it is clocked in, there is no write cycle
+
+  if(i2c_profile(deviceaddress)->write_cycle_ms) {
+     busy |= DEVICE_BIT(deviceaddress);
+     busy_address[deviceaddress & 0x07] = deviceaddress;
+  }
+}
+
+#if I2C_WRITE_QUEUE
+
+#if I2C_WRITE_QUEUE < I2C_WIRE_BUFFER + 4
+  #error I2C_WRITE_QUEUE must hold at least one page write
+#endif
+
+// Page writes not sent yet: a header and the data, in the order they were
+// submitted. The writes of one chip go out in that order, those of another
+// chip pass them while the first one is in its write cycle
+
+struct QUEUED_WRITE {
+
+  uint8_t  device;
+  uint8_t  length;
+  uint32_t eeaddress;
+
+} __attribute__ ((packed));
+
+static uint8_t  queue[I2C_WRITE_QUEUE];
+static uint16_t queue_used;
+static bool     queue_done;             // Writes completed since the last callback
+static void   (*queue_callback)();
+
+static void i2c_issue()
+{
+  // Sends the oldest write of every chip that is not busy
+
+  uint8_t  passed = 0;                  // Chips with an older write still queued
+  uint16_t at     = 0;
+
+  while(at < queue_used) {
+
+     QUEUED_WRITE* entry      = (QUEUED_WRITE*)(queue + at);
+     uint8_t       device_bit = DEVICE_BIT(entry->device);
+     uint16_t      record     = sizeof(QUEUED_WRITE) + entry->length;
+
+     if(!(passed & device_bit) && i2c_idle(entry->device)) {
+        i2c_page_write(entry->device, entry->eeaddress, queue + at + sizeof(QUEUED_WRITE), entry->length);
+        queue_used -= record;
+        memmove(queue + at, queue + at + record, queue_used - at);
+        queue_done  = true;
+     } else {
+        at += record;
+     }
+
+     passed |= device_bit;
+  }
+}
+
+static bool i2c_drain(uint16_t room)
+{
+  // Waits for the chip of the oldest write until room bytes are free
+
+  while(I2C_WRITE_QUEUE - queue_used < room) {
+     if(!i2c_settle(((QUEUED_WRITE*) queue)->device)) return false;
+     i2c_issue();
+  }
+
+  return true;
+}
+
+static void i2c_overlay(int deviceaddress, uint32_t eeaddress, uint8_t* data, uint32_t data_len)
+{
+  // Queued writes are newer than the array: they are laid over what was
+  // read, oldest first
+
+  QUEUED_WRITE* entry;
+
+  for(uint16_t at = 0; at < queue_used; at += sizeof(QUEUED_WRITE) + entry->length) {
+
+     entry = (QUEUED_WRITE*)(queue + at);
+     if(entry->device != deviceaddress) continue;
+
+     uint32_t from = max(entry->eeaddress, eeaddress);
+     uint32_t to   = min(entry->eeaddress + entry->length, eeaddress + data_len);
+
+     if(from < to) {
+        memcpy(data + (from - eeaddress), queue + at + sizeof(QUEUED_WRITE) + (from - entry->eeaddress), to - from);
+     }
+  }
+}
+
+#endif
+
+// ---------------------------------------------------------------------------------------------
+
+void i2c_set_profile(int deviceaddress, const DEVICE_PROFILE& device_profile)
+{
+  i2c_wait_idle();
+  profiles[deviceaddress & 0x07] = &device_profile;
+  next_address_valid            &= ~DEVICE_BIT(deviceaddress);
+}
+
+// ---------------------------------------------------------------------------------------------
+
+bool i2c_wait_idle()
+{
+  bool ready = true;
+
+  #if I2C_WRITE_QUEUE
+  ready = i2c_drain(I2C_WRITE_QUEUE);
+  #endif
+
+  for(uint8_t i = 0; i < 8; i++) {
+     if(busy & (1 << i)) ready &= i2c_settle(busy_address[i]);
+  }
+
+  return ready;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+bool i2c_poll()
+{
+  // Done when nothing is queued and no chip is in its write cycle
+
+  #if I2C_WRITE_QUEUE
+  i2c_issue();
+  if(queue_used) return false;
+  #endif
+
+  for(uint8_t i = 0; i < 8; i++) {
+     if((busy & (1 << i)) && !i2c_idle(busy_address[i])) return false;
+  }
+
+  #if I2C_WRITE_QUEUE
+  if(queue_done) {
+     queue_done = false;
+     if(queue_callback) queue_callback();
+  }
+  #endif
+
+  return true;
+}
+
+void i2c_set_callback(void (*callback)())
+{
+  #if I2C_WRITE_QUEUE
+  queue_callback = callback;
+  #endif
+}
+
+// ---------------------------------------------------------------------------------------------
+
+uint16_t i2c_write_span(int deviceaddress, uint32_t eeaddress)
+{
+  // Bytes from eeaddress that go out in one page write
+
+  const DEVICE_PROFILE* profile = i2c_profile(deviceaddress);
+
+  uint16_t bytes_write = profile->page_size - (eeaddress & (profile->page_size - 1));
+  return min(bytes_write, I2C_WIRE_BUFFER - 2);
+}
+
+// ---------------------------------------------------------------------------------------------
+
+void i2c_set_address(int deviceaddress, uint32_t eeaddress, bool close)
+{
+  Wire.beginTransmission(i2c_device(deviceaddress, eeaddress));
   Wire.write((int)((eeaddress) >> 8));   // MSB
   Wire.write((int)((eeaddress) & 0xFF)); // LSB
   if(close) Wire.endTransmission();
@@ -12,57 +253,140 @@ void i2c_set_address(int deviceaddress, unsigned int eeaddress, bool close)
 
 // ---------------------------------------------------------------------------------------------
 
-void i2c_write_buffer(int deviceaddress, unsigned int eeaddress, uint8_t* data, int data_len) 
+bool i2c_wait_ready(int deviceaddress)
 {
-  // Uses Page Write for 24LC256
-  // Allows for 64 byte page boundary
-  // Splits string into max 16 byte writes
+  // ACK polling: the chip does not acknowledge its address while the
+  // internal write cycle runs. Gives up after twice the tWC of the profile
+
+  unsigned long start   = micros();
+  unsigned long timeout = i2c_profile(deviceaddress)->write_cycle_ms * 2000UL;
+  unsigned long waited;
+  bool          ready;
+
+  do {
+     Wire.beginTransmission(deviceaddress);
+     ready  = (Wire.endTransmission() == 0);
+     waited = micros() - start;
+  } while(!ready && waited < timeout);
+
+  i2c_stats.last_wait_us  = waited;
+  i2c_stats.wait_us      += waited;
+  if(waited > i2c_stats.max_wait_us) i2c_stats.max_wait_us = waited;
+  if(!ready) i2c_stats.timeouts++;
+
+  return ready;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+bool i2c_write_buffer(int deviceaddress, uint32_t eeaddress, uint8_t* data, uint32_t data_len) 
+{
+  // Uses Page Write with the page size of the chip profile
+  // One write per physical page, split only where the Wire buffer
+  // can not take the whole page after the 2 address bytes. Pages never
+  // cross a 64 KB bank, so each write goes to a single device address.
+  // With a write queue the page writes are copied to it and sent by
+  // i2c_poll(), or here when the queue has no room left
+
+  const DEVICE_PROFILE* profile = i2c_profile(deviceaddress);
+
+  uint32_t  next_page;
+  uint16_t  bytes_write;
 
-  unsigned int  next_page;
   while(data_len)  {
 
-     next_page  = ((eeaddress >> 4) + 1) << 4;
-     i2c_set_address(deviceaddress, eeaddress, false);
-     while(data_len && eeaddress < next_page) {
-        Wire.write((uint8_t) *data++);
-        eeaddress++;
-        data_len--;
-     }
-     Wire.endTransmission();
-     delay(6);  // needs 5ms for page write
+     next_page   = (eeaddress | (profile->page_size - 1)) + 1;
+     bytes_write = min(data_len, next_page - eeaddress);
+     bytes_write = min(bytes_write, I2C_WIRE_BUFFER - 2);
+
+     #if I2C_WRITE_QUEUE
+
+     if(!i2c_drain(sizeof(QUEUED_WRITE) + bytes_write)) return false;
+
+     QUEUED_WRITE* entry = (QUEUED_WRITE*)(queue + queue_used);
+     entry->device       = deviceaddress;
+     entry->length       = bytes_write;
+     entry->eeaddress    = eeaddress;
+     memcpy(queue + queue_used + sizeof(QUEUED_WRITE), data, bytes_write);
+     queue_used         += sizeof(QUEUED_WRITE) + bytes_write;
+
+     #else
+
+     if(!i2c_settle(deviceaddress)) return false;
+     i2c_page_write(deviceaddress, eeaddress, data, bytes_write);
+
+     #endif
+
+     data      += bytes_write;
+     eeaddress += bytes_write;
+     data_len  -= bytes_write;
   }
+
+  #if I2C_WRITE_QUEUE
+  i2c_issue();
+  #endif
+
+  return true;
 }
  
 // ---------------------------------------------------------------------------------------------
 
-void i2c_read_buffer(int deviceaddress, unsigned int eeaddress, uint8_t* data, int data_len) 
+bool i2c_read_buffer(int deviceaddress, uint32_t eeaddress, uint8_t* data, uint32_t data_len) 
 {
-  // Uses Page Write for 24LC256
-  // Allows for 64 byte page boundary
-  // Splits string into max 16 byte reads
+  // Sets the address once and streams the data in bursts as big as the
+  // Wire buffer. The chip's address counter increments across pages, so
+  // the next requestFrom goes on where the last one stopped, up to the end
+  // of the 64 KB bank where it rolls over: a read across banks addresses
+  // the next one again. No address at all when the counter already points
+  // at eeaddress
 
-  unsigned int  next_page;
-  unsigned int  bytes_read;
-  unsigned int  len = data_len;
-  char          c = 1;
+  uint16_t  bytes_read;
+  uint32_t  bytes_bank;
+  uint32_t  bank       = min(i2c_profile(deviceaddress)->size, (uint32_t) 0x10000) - 1;
+  uint8_t   device_bit = DEVICE_BIT(deviceaddress);
 
-  while(len)  {
+  #if I2C_WRITE_QUEUE
+  uint8_t*  read_data    = data;
+  uint32_t  read_address = eeaddress;
+  uint32_t  read_len     = data_len;
+  #endif
 
-     next_page  = ((eeaddress >> 4) + 1) << 4;
-     bytes_read = min(len, (next_page - eeaddress));
-     
-     i2c_set_address(deviceaddress, eeaddress, true);
-     Wire.requestFrom(deviceaddress, bytes_read);
+  if(!i2c_settle(deviceaddress)) return false;
 
-     while(Wire.available()) { 
+  while(data_len)  {
 
-        c = Wire.read();
-        *data++ = c;
-        eeaddress++;
-        len--;
+     int device = i2c_device(deviceaddress, eeaddress);
+     bytes_bank = min(data_len, bank + 1 - (eeaddress & bank));
 
+     if(!(next_address_valid & device_bit) ||
+        next_address[deviceaddress & 0x07] != eeaddress) {
+        i2c_set_address(deviceaddress, eeaddress, true);
+     }
+
+     next_address[deviceaddress & 0x07] = (eeaddress & ~bank) | ((eeaddress + bytes_bank) & bank);
+     next_address_valid |= device_bit;
+
+     eeaddress += bytes_bank;
+     data_len  -= bytes_bank;
+
+     while(bytes_bank)  {
+
+        bytes_read = min(bytes_bank, I2C_WIRE_BUFFER);
+        if(!Wire.requestFrom(device, bytes_read)) {
+           next_address_valid &= ~device_bit;
+           return false;
+        }
+
+        while(Wire.available()) { 
+           *data++ = Wire.read();
+           bytes_bank--;
+        }
      }
   }
 
+  #if I2C_WRITE_QUEUE
+  i2c_overlay(deviceaddress, read_address, read_data, read_len);
+  #endif
+
+  return true;
 }
- 
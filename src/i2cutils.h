@@ -2,7 +2,48 @@
 #include <stddef.h>
 #include <inttypes.h>
 #include <Wire.h>
+#include "i2cfs_devices.h"
 
-void i2c_set_address(int deviceaddress, unsigned int eeaddress, bool close);
-void i2c_write_buffer(int deviceaddress, unsigned int eeaddress, uint8_t* data, int data_len);
-void i2c_read_buffer(int deviceaddress, unsigned int eeaddress, uint8_t* data, int data_len);
+// Bytes one Wire transaction can carry, memory address included
+
+#ifndef I2C_WIRE_BUFFER
+  #if defined(BUFFER_LENGTH)            // AVR, ESP8266
+    #define I2C_WIRE_BUFFER BUFFER_LENGTH
+  #elif defined(I2C_BUFFER_LENGTH)      // ESP32
+    #define I2C_WIRE_BUFFER I2C_BUFFER_LENGTH
+  #else
+    #define I2C_WIRE_BUFFER 32
+  #endif
+#endif
+
+// Bytes of RAM for page writes waiting to be sent, 0 = every write is sent
+// right away. With a queue i2c_write_buffer() returns as soon as the data
+// is copied, and i2c_poll() sends what the chips can take
+
+#ifndef I2C_WRITE_QUEUE
+  #define I2C_WRITE_QUEUE 0
+#endif
+
+// Write cycles and how long the driver really waited for them
+
+struct I2C_STATS {
+
+  uint32_t write_cycles;              // Page writes issued
+  uint32_t wait_us;                   // Total time spent ACK polling
+  uint16_t last_wait_us;              // Wait of the last write cycle
+  uint16_t max_wait_us;               // Longest write cycle seen
+  uint16_t timeouts;                  // Write cycles not done within the bound
+
+};
+
+extern I2C_STATS i2c_stats;
+
+void i2c_set_profile(int deviceaddress, const DEVICE_PROFILE& profile);
+void i2c_set_address(int deviceaddress, uint32_t eeaddress, bool close);
+bool i2c_wait_ready(int deviceaddress);
+bool i2c_wait_idle();
+bool i2c_poll();
+void i2c_set_callback(void (*callback)());
+uint16_t i2c_write_span(int deviceaddress, uint32_t eeaddress);
+bool i2c_write_buffer(int deviceaddress, uint32_t eeaddress, uint8_t* data, uint32_t data_len);
+bool i2c_read_buffer(int deviceaddress, uint32_t eeaddress, uint8_t* data, uint32_t data_len);
@@ -0,0 +1,228 @@
+#include "i2cfs_config.h"
+
+#ifdef DRIVER_SPI
+
+#include "spiutils.h"
+
+// 25xx / FM25 command set
+
+#define SPI_WREN  0x06                  // Write enable, needed before every write
+#define SPI_RDSR  0x05                  // Read status register
+#define SPI_READ  0x03
+#define SPI_WRITE 0x02
+
+#define SPI_STATUS_WIP 0x01             // Write in progress
+
+SPI_STATS spi_stats;
+
+// Chip select pins seen so far, set as outputs on first use, and the
+// profile of the chip on each. A bit of busy per pin: the chip has a write
+// cycle running and has to be polled before the next command
+
+static uint8_t pins[8];
+static const DEVICE_PROFILE* profiles[8];
+static uint8_t pin_count;
+static uint8_t busy;
+static bool    written;                 // Writes completed since the last callback
+static void  (*write_callback)();
+
+static uint8_t spi_chip(int pin)
+{
+  for(uint8_t i = 0; i < pin_count; i++) {
+     if(pins[i] == pin) return i;
+  }
+
+  if(!pin_count) SPI.begin();
+
+  pinMode(pin, OUTPUT);
+  digitalWrite(pin, HIGH);
+
+  if(pin_count == sizeof(pins)) pin_count--;   // More than a volume takes, reuse the last
+  pins[pin_count]     = pin;
+  profiles[pin_count] = &DEVICE_FM25V02;
+  return pin_count++;
+}
+
+static const DEVICE_PROFILE* spi_profile(int pin)
+{
+  return profiles[spi_chip(pin)];
+}
+
+static void spi_select(int pin, uint8_t command)
+{
+  SPI.beginTransaction(SPISettings(SPI_MEM_CLOCK, MSBFIRST, SPI_MODE0));
+  digitalWrite(pin, LOW);
+  SPI.transfer(command);
+}
+
+static void spi_address(int pin, uint32_t eeaddress)
+{
+  // Parts over 64 KB take a 24-bit address
+
+  if(spi_profile(pin)->size > 0x10000) SPI.transfer((uint8_t)(eeaddress >> 16));
+  SPI.transfer((uint8_t)(eeaddress >> 8));
+  SPI.transfer((uint8_t) eeaddress);
+}
+
+static void spi_release(int pin)
+{
+  digitalWrite(pin, HIGH);
+  SPI.endTransaction();
+}
+
+static bool spi_ready(int pin)
+{
+  spi_select(pin, SPI_RDSR);
+  uint8_t status = SPI.transfer(0);
+  spi_release(pin);
+
+  return !(status & SPI_STATUS_WIP);
+}
+
+static bool spi_settle(int pin)
+{
+  uint8_t chip_bit = 1 << spi_chip(pin);
+
+  if(!(busy & chip_bit)) return true;
+  busy &= ~chip_bit;
+  return spi_wait_ready(pin);
+}
+
+// ---------------------------------------------------------------------------------------------
+
+void spi_set_profile(int pin, const DEVICE_PROFILE& device_profile)
+{
+  spi_wait_idle();
+  profiles[spi_chip(pin)] = &device_profile;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+bool spi_wait_ready(int pin)
+{
+  // Polls the WIP bit of the status register. Gives up after twice the tWC
+  // of the profile
+
+  unsigned long start   = micros();
+  unsigned long timeout = spi_profile(pin)->write_cycle_ms * 2000UL;
+  unsigned long waited;
+  bool          ready;
+
+  do {
+     ready  = spi_ready(pin);
+     waited = micros() - start;
+  } while(!ready && waited < timeout);
+
+  spi_stats.last_wait_us  = waited;
+  spi_stats.wait_us      += waited;
+  if(waited > spi_stats.max_wait_us) spi_stats.max_wait_us = waited;
+  if(!ready) spi_stats.timeouts++;
+
+  return ready;
+}
+
+bool spi_wait_idle()
+{
+  bool ready = true;
+
+  for(uint8_t i = 0; i < pin_count; i++) {
+     if(busy & (1 << i)) ready &= spi_settle(pins[i]);
+  }
+
+  return ready;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+bool spi_poll()
+{
+  // Writes are sent right away, only write cycles can still run
+
+  for(uint8_t i = 0; i < pin_count; i++) {
+     if(!(busy & (1 << i))) continue;
+     if(!spi_ready(pins[i])) return false;
+     busy &= ~(1 << i);
+  }
+
+  if(written) {
+     written = false;
+     if(write_callback) write_callback();
+  }
+
+  return true;
+}
+
+void spi_set_callback(void (*callback)())
+{
+  write_callback = callback;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+uint16_t spi_write_span(int pin, uint32_t eeaddress)
+{
+  // Bytes from eeaddress that go out in one page write
+
+  const DEVICE_PROFILE* profile = spi_profile(pin);
+
+  return profile->page_size - (eeaddress & (profile->page_size - 1));
+}
+
+// ---------------------------------------------------------------------------------------------
+
+bool spi_write_buffer(int pin, uint32_t eeaddress, uint8_t* data, uint32_t data_len)
+{
+  // One write per physical page, each after its own write enable. FRAM
+  // has no pages (its page_size only bounds one write) and no write
+  // cycle: the data is stored as it is clocked in, there is nothing to poll
+
+  const DEVICE_PROFILE* profile = spi_profile(pin);
+
+  uint32_t  next_page;
+  uint32_t  bytes_write;
+  uint8_t   chip_bit = 1 << spi_chip(pin);
+
+  while(data_len)  {
+
+     next_page   = (eeaddress | (profile->page_size - 1)) + 1;
+     bytes_write = min(data_len, next_page - eeaddress);
+
+     if(!spi_settle(pin)) return false;
+
+     spi_select(pin, SPI_WREN);
+     spi_release(pin);
+
+     spi_select(pin, SPI_WRITE);
+     spi_address(pin, eeaddress);
+     for(uint32_t i = 0; i < bytes_write; i++) SPI.transfer(data[i]);
+     spi_release(pin);
+
+     spi_stats.write_cycles++;
+     if(profile->write_cycle_ms) busy |= chip_bit;
+
+     data      += bytes_write;
+     eeaddress += bytes_write;
+     data_len  -= bytes_write;
+  }
+
+  written = true;
+  return true;
+}
+
+// ---------------------------------------------------------------------------------------------
+
+bool spi_read_buffer(int pin, uint32_t eeaddress, uint8_t* data, uint32_t data_len)
+{
+  // One READ command streams the whole range, across pages and banks
+
+  if(!spi_settle(pin)) return false;
+
+  spi_select(pin, SPI_READ);
+  spi_address(pin, eeaddress);
+  while(data_len--) *data++ = SPI.transfer(0);
+  spi_release(pin);
+
+  return true;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#include <Arduino.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <SPI.h>
+#include "i2cfs_devices.h"
+
+// Clock of the SPI bus. FRAM takes 20 MHz and more, 25LCxx EEPROMs 10 MHz
+// at 5 V and less at 3.3 V
+
+#ifndef SPI_MEM_CLOCK
+  #define SPI_MEM_CLOCK 8000000
+#endif
+
+// Write cycles and how long the driver really waited for them. Parts with
+// no write cycle in their profile (FRAM) are never polled
+
+struct SPI_STATS {
+
+  uint32_t write_cycles;              // Page writes issued
+  uint32_t wait_us;                   // Total time spent polling the status register
+  uint16_t last_wait_us;              // Wait of the last write cycle
+  uint16_t max_wait_us;               // Longest write cycle seen
+  uint16_t timeouts;                  // Write cycles not done within the bound
+
+};
+
+extern SPI_STATS spi_stats;
+
+// The chip is the pin of its chip select, chips of a striped volume are on
+// consecutive pins
+
+void spi_set_profile(int pin, const DEVICE_PROFILE& profile);
+bool spi_wait_ready(int pin);
+bool spi_wait_idle();
+bool spi_poll();
+void spi_set_callback(void (*callback)());
+uint16_t spi_write_span(int pin, uint32_t eeaddress);
+bool spi_write_buffer(int pin, uint32_t eeaddress, uint8_t* data, uint32_t data_len);
+bool spi_read_buffer(int pin, uint32_t eeaddress, uint8_t* data, uint32_t data_len);